@@ -8,15 +8,28 @@
  *         -Wl,--gc-sections -o alix-leds alix-leds.c 
  *  $ sstrip alix-leds
  *
+ * To benchmark the parsers on captured /proc files (see main() for BENCH) :
+ *  $ make bench
+ *  $ make bench BENCH_ARGS="-i eth0 netdev:/proc/net/dev stat:contrib/bench/stat-64cpu.txt"
+ *
+ * To replay a scripted scenario on a virtual clock (see sim_parse_line()) and
+ * compare the resulting LED waveform with a reference one :
+ *  $ make sim-check
+ *  $ ./alix-leds-sim -l 1 -i eth0 -l 2 -u -X scenario.txt | diff -u ref.txt -
+ *
  * For more info about usage, check the "usage" help string below.
  */
 
 #include <ctype.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <errno.h>
@@ -24,14 +37,42 @@
 #include <net/if.h>
 #include <sys/io.h>
 #include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include <linux/types.h>
+#include <linux/gpio.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <linux/sockios.h>
 
+#ifdef BENCH
+/* the benchmark counts the allocations made by the parsers */
+static unsigned int bench_allocs;
+
+static void *bench_malloc(size_t size)
+{
+	bench_allocs++;
+	return malloc(size);
+}
+
+static void *bench_realloc(void *ptr, size_t size)
+{
+	bench_allocs++;
+	return realloc(ptr, size);
+}
+
+#define malloc(s)     bench_malloc(s)
+#define realloc(p, s) bench_realloc(p, s)
+#endif
+
 /* for passing single values */
 struct ethtool_value {
         __u32     cmd;
@@ -41,12 +82,31 @@ struct ethtool_value {
 #define FIRST_SIG 32
 #define LAST_SIG  63
 
+/* for reading the link speed */
+struct ethtool_speed {
+	__u32     cmd;
+	__u32     supported;
+	__u32     advertising;
+	__u16     speed;
+	__u8      duplex, port, phy_address, transceiver, autoneg, mdio_support;
+	__u32     maxtxpkt, maxrxpkt;
+	__u16     speed_hi;
+	__u8      eth_tp_mdix, eth_tp_mdix_ctrl;
+	__u32     lp_advertising;
+	__u32     reserved[2];
+};
+
+#define ETHTOOL_GSET  0x1
 #define ETHTOOL_GLINK 0xa
 
 #ifndef SIOCETHTOOL
 #define SIOCETHTOOL     0x8946
 #endif
 
+#ifndef IFF_LOWER_UP
+#define IFF_LOWER_UP    0x10000
+#endif
+
 #undef SCHED_IDLEPRIO
 #define SCHED_IDLEPRIO  5
 
@@ -63,6 +123,32 @@ struct ethtool_value {
 #define SWITCH_PORT 0x61B0
 #define SWITCH_MASK 0x0100
 
+/* switch timings : the state is sampled once it remained stable for the
+ * debounce time, or every poll period without edge reporting. A press is long
+ * when held for SWITCH_LONG, and double when the next one starts within
+ * SWITCH_DOUBLE after the release.
+ */
+#define SWITCH_DEBOUNCE (SLEEP_1SEC * 20/1000)
+#define SWITCH_POLL     (SLEEP_1SEC * 50/1000)
+#define SWITCH_DOUBLE   (SLEEP_1SEC * 400/1000)
+#define SWITCH_LONG     (2 * SLEEP_1SEC)
+
+/* switch presses which may trigger an action */
+enum {
+	PRESS_SHORT  = 0,
+	PRESS_LONG   = 1,
+	PRESS_DOUBLE = 2,
+	PRESSES,
+};
+
+/* switch states */
+enum {
+	SW_IDLE = 0, /* released */
+	SW_DOWN = 1, /* pressed, may become a long press */
+	SW_HELD = 2, /* press already reported, waiting for the release */
+	SW_UP   = 3, /* released, may be followed by a double press */
+};
+
 /* ALIX leds */
 #define LED1_PORT 0x6100
 #define LED2_PORT 0x6180
@@ -75,12 +161,46 @@ struct ethtool_value {
 /* used by network leds */
 #define MAXSTEPS  2
 
+/* full scale of traffic leds for interfaces of unknown speed, in Mb/s */
+#define TRAFFIC_SPEED 100
+
+/* default threshold below which error leds (errors per second) and pressure
+ * leds (percent of stall time) remain off.
+ */
+#define DEF_THRESHOLD 10
+
+/* default threshold below which interrupt leds remain off, in interrupts per
+ * second. Busy devices easily take thousands per second.
+ */
+#define DEF_IRQ_RATE  1000
+
+/* default trip point of thermal leds, and the range below it over which they
+ * blink faster as the temperature rises, in degrees Celsius.
+ */
+#define DEF_TRIP      85
+#define THERMAL_RANGE 20
+
 enum {
 	LED_UNUSED = 0,
 	LED_NET = 1,
 	LED_RUNNING = 2,
 	LED_CPU = 3,
 	LED_DISK = 4,
+	LED_TRAFFIC = 5,
+	LED_ERRORS = 6,
+	LED_PSI = 7,
+	LED_LOAD = 8,
+	LED_THERMAL = 9,
+	LED_CONNTRACK = 10,
+	LED_IRQ = 11,
+};
+
+/* resources reporting pressure stall information */
+enum {
+	PSI_CPU    = 0,
+	PSI_MEMORY = 1,
+	PSI_IO     = 2,
+	PSI_RES    = 3, /* number of resources */
 };
 
 /* The check indicates if we are allowed to run ethtool checks on the interface
@@ -93,8 +213,14 @@ enum {
 	IF_CHECK_LOGICAL  = 2,  /* only check admin status */
 	IF_CHECK_PHYSICAL = 4,  /* check physical status   */
 	IF_CHECK_BOTH     = 6,  /* check both logical and physical */
+	IF_CHECK_IGNORE   = 8,  /* name matching no pattern, not tracked */
+	IF_CHECK_COUNTERS = 16, /* collect the traffic and error counters */
+	IF_CHECK_DYNAMIC  = 32, /* discovered from a pattern, freed once gone */
 };
 
+/* characters making an interface name a pattern */
+#define IF_PATTERN_CHARS "*?["
+
 /* status values reported by check_if_list() */
 enum {
 	ETH_UP   = 1,
@@ -107,45 +233,140 @@ struct if_status {
 	const char *name;
 	int check;  /* bit field of IF_CHECK_* */
 	int status; /* bit field of IF_CHECK_* */
+	struct if_status *hnext; /* next interface in the same hash bucket */
+	struct if_status *next;  /* next tracked interface */
+	unsigned int bytes;      /* rx+tx bytes, for IF_CHECK_COUNTERS */
+	unsigned int errors;     /* rx+tx errors, drops and fifo errors */
+	unsigned int speed;      /* link speed in Mb/s, 0 if unknown */
+	int seen;                /* looked up since the last if_sweep() */
+};
+
+/* CPU usage aggregation modes */
+enum {
+	CPU_MEAN = 0,  /* mean usage of all CPUs */
+	CPU_MAX  = 1,  /* usage of the most loaded CPU */
+	CPU_CORE = 2,  /* usage of CPU number (mode - CPU_CORE) */
+};
+
+struct cpu_sample {
+	unsigned int total, idle; /* jiffies */
 };
 
 struct cpu_status {
-	unsigned int cpu_total[2], cpu_idle[2];
+	int mode;  /* CPU_MEAN, CPU_MAX or CPU_CORE + core number */
+	int nbcpu; /* number of allocated entries in <prev> */
+	struct cpu_sample *prev; /* [0]=all CPUs, [1+n]=CPU n, last consumed */
+	unsigned int seq;  /* /proc/stat read last consumed */
+	unsigned int cpu_total[2], cpu_idle[2]; /* from /proc/uptime */
 	unsigned int cpu_usage;
 };
 
+/* Disk activity is measured from the number of I/Os completed on the block
+ * devices whose numbers are in <devs>. When no such device is found, the
+ * number of IDE interrupts is used instead.
+ */
 struct ide_status {
 	unsigned int count[2];
 	unsigned int disk_usage;
+	int *devs;           /* entries of disk_devs[] matching the led */
+	int nbstats;         /* 0 = not initialized, <0 = count IRQs instead */
 };
 
+/* A kernel source shared by all the leds using it. It's read at most once
+ * per SAMPLE_PERIOD whatever the number of leds and metrics using it, and
+ * only keeps the values of its last read, with its date and its number. The
+ * leds keep the values they last consumed, so that they compute the deltas
+ * over their own sampling interval.
+ */
+struct source {
+	unsigned int seq;    /* number of reads, 0 = never read */
+	unsigned int date;   /* date of the last read */
+};
+
+#define SAMPLE_PERIOD 50000
+
 struct if_list {
 	struct if_status *ifs;
 	struct if_list *next;
 	int prev_status;
 };
 
+/* An interface name pattern passed to -i, -s or -t. The interfaces matching
+ * it are tracked when they appear, and inserted into the LED's list just
+ * after <list>, the pattern's own element which always reports an absent
+ * interface. <list> is NULL for patterns not associated to any LED.
+ */
+struct if_pattern {
+	const char *pattern;
+	int check;
+	struct if_list *list;
+};
+
+/* A task is woken up at an absolute date <expire>, expressed in microseconds
+ * on the monotonic clock. It wraps every 71 minutes so dates must only be
+ * compared using date_before(). Queued tasks are ordered in a min-heap.
+ */
+struct task {
+	unsigned int expire;  /* absolute wake up date in microseconds */
+	int heap;             /* position in the heap, <0 if not queued */
+	void (*process)(struct task *t);
+	void *context;
+};
+
+/* An event handler, see ev_register() */
+struct evh {
+	int fd;
+	void (*iocb)(); /* called when fd is readable */
+};
+
 struct led {
 	int type;  /* led type (LED_*). 0 = unused */
 	int state; /* internal state. 0 at init. 1 for first state. */
-	int sleep; /* sleep time in ms */
-	unsigned int port; /* I/O port */
-	unsigned int mask; /* on/off mask */
-	char *disk_name;
+	int sleep; /* time to wait before next call, in microseconds */
+	struct task task;
+	char *disk_name; /* block device name or pattern, NULL for all disks */
 	struct if_list *intf, *slave, *tun; /* checked interfaces */
 	struct cpu_status cpu;
 	struct ide_status ide;
 	int count, limit, flash;   /* used for interface status */
+	unsigned int level;        /* 0..100, blink rate of level leds */
+	unsigned int threshold;    /* errors per second or percent reported */
+	int psi_res;               /* PSI_* resource of pressure leds */
+	struct evh psi_evh;        /* PSI trigger, fd <0 if not supported */
+	unsigned int prev_count, prev_seq; /* counters at the last sample */
+	unsigned int prev_date;
+	struct pfile *therm;       /* temperature sensors of thermal leds */
+	int nbtherm;
+	int trip;                  /* trip point of thermal leds, in mC */
+	int *irqs;                 /* entries of irq_pats[] counted by the led */
+	int nbirqs;
 };
 
-#define MAXIFS 8
-#define MAXIFL (MAXIFS*3)   // about MAXIFS times NBLEDs
+#define NBLEDS 3
 
-static struct led leds[3];
-static struct if_status ifs[MAXIFS];
-static int nbifs;
-static struct if_list ifl[MAXIFL];
-static int nbifl;
+static struct led leds[NBLEDS];
+
+/* The tracked interfaces, the LEDs interface lists and the patterns come
+ * from a single arena allocated at startup by if_alloc(), sized for the
+ * number of interfaces which may be passed on the command line. Interfaces
+ * discovered from patterns are allocated when they first appear, with their
+ * LED list elements. All interfaces are indexed by name in a hash table whose
+ * size is a power of two, doubled when it holds more names than buckets, and
+ * the tracked ones are chained from <if_tracked>. The discovered interfaces
+ * and the names matching no pattern are forgotten once they disappear.
+ */
+static struct if_status *ifs;
+static int nbifs, maxifs;
+static struct if_list *ifl;
+static int nbifl, maxifl;
+static struct if_pattern *ifp;
+static int nbifp;
+static struct if_status **if_hash;
+static unsigned int if_hash_mask;
+static unsigned int if_hashed;    /* number of names in the hash table */
+static int if_hash_grown;         /* the table is not the arena's anymore */
+static struct if_status *if_tracked;
+static struct if_status if_pattern_status = { .name = "" }; /* never present */
 static unsigned char blink_pattern[LAST_SIG-FIRST_SIG]; /* patterns for signals FIRST_SIG..LAST_SIG-1 */
 
 /* blink pattern format is a 6-bit integer :
@@ -161,19 +382,123 @@ static unsigned char blink_pattern[LAST_SIG-FIRST_SIG]; /* patterns for signals
 
 /* network socket */
 static int net_sock;  /* -2 = unneeded, -1 = needed, >=0 = initialized */
+static int nl_sock;   /* rtnetlink socket for link events, <0 if polling */
+static int net_poll;  /* force polling of /proc/net/dev instead of netlink */
+static int net_counters; /* /proc/net/dev must be read for the counters */
 static int fast_mode; /* start blink fast for running led */
-static int blinker_remain; /* minimum time the blinker mode must remain */
 static int blink_mode; /* number of the last received signal to be handled */
 static int blink_restore; /* leds status to restore */
 
-/* how much time the blink handler must sleep */
-static int blinker_sleep;
+static unsigned int blinker_end; /* date before which the blinker must remain */
+
+/* Actions run upon switch presses, NULL if none. The switch is only watched
+ * by the daemon if at least one is set.
+ */
+static const char *switch_actions[PRESSES];
+static const char *switch_press_names[PRESSES] = {
+	[PRESS_SHORT]  = "short",
+	[PRESS_LONG]   = "long",
+	[PRESS_DOUBLE] = "double",
+};
+static int switch_state;  /* SW_* */
+static int switch_last;   /* last sample of a polled switch */
+static int switch_edges;  /* the switch reports edges, it is not polled */
+static unsigned int switch_date; /* date of the last press or release */
+
+/* Signals are blocked and read from sig_fd in the event loop. If signalfd is
+ * not supported, the handler only marks them pending for the loop.
+ */
+static int sig_fd;
+static volatile char sig_pending[LAST_SIG + 1];
+static volatile char sig_any;
+
+/* current date in microseconds, updated at each scheduler iteration */
+static unsigned int now;
+
+/* All event sources are registered into a single epoll fd so that the
+ * daemon only sleeps in epoll_wait(). Tasks deadlines are reported by a
+ * timerfd re-armed to the next deadline when it changes.
+ */
+static int ep_fd;
+static struct evh sig_evh, nl_evh, timer_evh, switch_evh;
+static unsigned int timer_date; /* date the timer is armed for */
+static int timer_armed;
+
+/* In low power mode, wakeups are aligned on a grid of <grid> microseconds
+ * starting at <grid_base>, so that all tasks expiring within the same grid
+ * interval are processed in a single wakeup. Tasks keep their own deadlines
+ * so that the timings do not drift.
+ */
+static unsigned int grid, grid_base;
+
+#ifdef SIMUL
+/* In simulation builds, the scheduler runs on a virtual clock which jumps
+ * from one deadline or scripted event to the next, and the inputs come from
+ * a script instead of the system. The clock does not wrap.
+ */
+static unsigned long long sim_clock; /* virtual date in microseconds */
+static const char *sim_script;
+#endif
+
+/* Statistics are collected unless building the smallest binary (QUIET
+ * without DEBUG), in which case the macros below cost nothing. They are
+ * dumped on SIGQUIT, to stderr in DEBUG mode, or to the stats file.
+ */
+#if defined(DEBUG) || !defined(QUIET)
+#define USE_STATS
+#endif
+
+#ifdef USE_STATS
+#define STATS_ADD(f, v) (stats.f += (v))
+#define STATS_DATE()    get_date()
+#else
+#define STATS_ADD(f, v) ((void)(v))
+#define STATS_DATE()    0
+#endif
+#define STATS_INC(f)    STATS_ADD(f, 1)
+
+/* upper bounds of the timer lateness histogram buckets, in microseconds */
+static const unsigned short late_bounds[] = { 50, 100, 250, 500, 1000, 2500, 5000, 10000 };
+
+struct stats {
+	unsigned int start;        /* start date in seconds */
+	unsigned int loops;        /* returns from epoll_wait() */
+	unsigned int tasks;        /* tasks processed */
+	unsigned int timer_wakeups;
+	unsigned int late[sizeof(late_bounds)/sizeof(late_bounds[0]) + 1];
+	unsigned int late_max;     /* max timer lateness in microseconds */
+	unsigned int net_calls, net_time;   /* check_if_status(), time in us */
+	unsigned int cpu_calls, cpu_time;   /* update_cpu*() */
+	unsigned int disk_calls, disk_time; /* update_disk() */
+	unsigned int nl_reads, sig_reads, timer_calls, net_ioctls;
+	unsigned int led_writes;   /* outl(), pwrite() or ioctl() to LEDs */
+};
+
+#ifdef USE_STATS
+static struct stats stats;
+static const char *stats_file = "/var/run/alix-leds.stats";
+#endif
+
+#ifdef DEBUG
+static unsigned int wakeups_last, wakeups_last_report;
+#endif
+
+/* tasks heap, dynamically grown */
+static struct task **tasks;
+static int nbtasks, maxtasks;
+
+static struct task net_task, blinker_task, switch_task;
 
 /* This trash buffer may be used at will. It's mostly a buffer to store file
- * contents when parsing them. It should be enough to read stats for about 12
- * interfaces, and to read about 40 interrupts on an SMP machine.
+ * contents when parsing them. It is allocated at startup and grows to the
+ * size of the largest file read line by line, up to TRASH_MAX. Larger files
+ * are parsed in multiple chunks so that memory usage remains bounded.
  */
-static char trash[2048];
+#define TRASH_MIN 2048
+#define TRASH_MAX 65536
+
+static char *trash;
+static int trash_size;
 
 const char usage[] =
 #ifndef QUIET
@@ -181,8 +506,14 @@ const char usage[] =
   "  Blink LEDs on ALIX motherboards depending on system and network status.\n"
   "\n"
   "Usage:\n"
-  "  # alix-leds [-p pidfile] {[-l 1|2|3] [-durR] [-i intf] [-s slave] [-t tun]}*\n"
-  "              [-I] [-S] [-i intf] [ -b sig pat ]*\n"
+  "  # alix-leds [-p pidfile] {[-l 1|2|3] [-adkurR] [-c cpu] [-i intf] [-s slave]\n"
+  "              [-D disk] [-t tun] [-n intf] [-e intf] [-w res] [-E rate]\n"
+  "              [-T sensor] [-K trip] [-v dev]}*\n"
+  "              [-I] [-P] [-S] [-i intf] [ -b sig pat ]* [-B backend[:args]]\n"
+  "              [-L grid] [-q statsfile] [ -x press action ]*\n"
+#ifdef SIMUL
+  "              -X script\n"
+#endif
   "\n"
   "LEDs 1,2,3 are independently managed. Specify one led, followed by the checks\n"
   "to associate to that LED. Repeat for other leds. Network interface status can\n"
@@ -194,14 +525,57 @@ const char usage[] =
   "  - when all <slave> are down or absent, the LED blinks slowly (once a second).\n"
   "  - when all <tun> are down or absent, the LED flashes twice a second.\n"
   "  - after a status change, the LED flashes once.\n"
+  "Interface names may be shell patterns (eg: 'eth*', 'wg-*') matching the\n"
+  "interfaces as they appear.\n"
   "The 'running' more (-r) will slowly blink the led at 1 Hz. Using -R will blink\n"
   "it at 10 Hz. SIGUSR1 switches running leds to -r, SIGUSR2 switches them to -R.\n"
   "Use -p to store the daemon's pid into file <pidfile>. The 'usage' mode (-u)\n"
-  "reports CPU usage by blinking slower or faster depending on the load. -I sets\n"
-  "scheduling to idle priority (less precise). -d enables monitoring of hard disk.\n"
+  "reports CPU usage by blinking slower or faster depending on the load. -c does\n"
+  "the same for the CPUs designated by <cpu> : 'mean' (default), 'max' for the\n"
+  "most loaded one, or a CPU number. -a does the same for the run queue, from the\n"
+  "1 minute load average or the runnable tasks per online CPU. -I sets scheduling\n"
+  "to idle priority (less precise). -d enables monitoring of hard disks activity,\n"
+  "and -D restricts it to the block devices matching pattern <disk> (eg: 'sda',\n"
+  "'nvme*', 'mmcblk0p2').\n"
+  "-n reports the traffic of interface <intf> the same way, relative to the link\n"
+  "speed (100 Mb/s if unknown). Repeat it to sum the traffic of more interfaces.\n"
+  "-e reports the errors, drops and fifo errors of interface <intf>, flashing\n"
+  "faster as they get more frequent. The LED remains off below <rate> errors per\n"
+  "second set with -E (default 10), and flashes fastest at 10 times <rate>.\n"
+  "-w reports the pressure stall of resource <res> (cpu, memory or io) from its\n"
+  "10s average, remaining off below <rate> percent. When the kernel supports it,\n"
+  "it wakes the daemon up only once <rate> is exceeded within one second.\n"
+  "-T reports the temperature of thermal zone <sensor> (eg: 'thermal_zone0' or\n"
+  "'thermal_zone*'), or of file <sensor> if it starts with '/' (eg: a hwmon\n"
+  "temp1_input). Repeat it to follow the hottest of more sensors. The LED remains\n"
+  "off until 20 degrees below the trip point set with -K in degrees Celsius\n"
+  "(default 85), and blinks faster as it gets closer.\n"
+  "-k reports the occupancy of the conntrack table, blinking faster as it fills\n"
+  "up, and remaining lit once it is full.\n"
+  "-v reports the interrupts of the devices matching pattern <dev> (eg: 'eth0',\n"
+  "'enp1s0-TxRx-*' or 'ahci') the same way as -e does for errors, with <rate> in\n"
+  "interrupts per second (default 1000, so fastest at 10000 per second). Repeat\n"
+  "it to sum the interrupts of more devices.\n"
   "-S checks switch and returns 0 if pressed. Will also blink all specified leds.\n"
+  "Link changes are reported by the kernel when possible, -P forces polling.\n"
+  "-L enables low power mode, aligning wakeups on a grid of <grid> milliseconds.\n"
+  "SIGQUIT dumps internal statistics into <statsfile> (/var/run/alix-leds.stats).\n"
   "-b indicates led patterns to use upon signal reception (32..63). Sig 63 stops.\n"
   "Signal blinking automatically stops after 15s if at least one intf is plugged.\n"
+  "-x runs <action> when the switch is pressed. <press> is 'short', 'long' (held\n"
+  "for 2s) or 'double'. <action> is 'sig:<num>' to act as if signal <num> was\n"
+  "received (eg: 'sig:33' to blink pattern 33), otherwise a shell command.\n"
+  "The switch is only polled when the backend does not report its changes.\n"
+  "-B selects how LEDs are driven :\n"
+  "  - alix                          : ALIX GPIO ports (default)\n"
+  "  - sysfs:<led1>[,<led2>[,<led3>]] : LED names in /sys/class/leds\n"
+  "  - gpio:<chip>:<l1>[,<l2>[,<l3>]][:<switch>] : lines of GPIO chip <chip>, with\n"
+  "    '!' before active low lines (eg: gpio:gpiochip0:!68,!69,!70:!71)\n"
+  "  - sim:<file>                    : log timestamped LED changes into <file>\n"
+#ifdef SIMUL
+  "-X replays simulation script <script> on a virtual clock, the LED changes are\n"
+  "logged to stdout unless another backend is set.\n"
+#endif
 #endif
   "";
 
@@ -267,44 +641,260 @@ static void fdputs(int fd, const char *msg)
 	fdprint(fd, "\n");
 }
 
-/* open file <name> for read, read the maximum of it into <buffer>, but not
- * more than <size> bytes. A terminating zero is always added after a read
- * succeeds. The zero lies within <size> but is not counted in the return
- * value. The number of bytes read is returned. Zero is returned if the file
- * was empty, <0 is returned in case of any error.
+/* returns the current date in microseconds on the monotonic clock */
+static unsigned int get_date()
+{
+#ifdef SIMUL
+	return sim_clock;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000U + ts.tv_nsec / 1000;
+#endif
+}
+
+/* returns non-zero if date <a> is strictly before date <b>, taking care of
+ * the wrapping.
+ */
+static inline int date_before(unsigned int a, unsigned int b)
+{
+	return (int)(a - b) < 0;
+}
+
+/* A file which is opened once and read again from its beginning using
+ * pread() every time its contents are needed. This saves the open/close
+ * syscalls and the path lookup on each read.
+ */
+struct pfile {
+	const char *name;
+	int fd;          /* <0 if not opened */
+#ifdef USE_STATS
+	unsigned int opens, reads;
+#endif
+};
+
+static struct pfile pf_netdev     = { .name = "/proc/net/dev",    .fd = -1 };
+static struct pfile pf_uptime     = { .name = "/proc/uptime",     .fd = -1 };
+static struct pfile pf_stat       = { .name = "/proc/stat",       .fd = -1 };
+static struct pfile pf_interrupts = { .name = "/proc/interrupts", .fd = -1 };
+
+/* A block device whose stats are shared by all disk leds */
+struct disk_dev {
+	struct pfile pf;     /* /sys/block/<dev>/stat */
+	unsigned int ios;    /* reads and writes completed at the last read */
+};
+
+static struct pfile pf_loadavg     = { .name = "/proc/loadavg",    .fd = -1 };
+static struct pfile pf_cpu_online  = { .name = "/sys/devices/system/cpu/online", .fd = -1 };
+static struct pfile pf_ct_count    = { .name = "/proc/sys/net/netfilter/nf_conntrack_count", .fd = -1 };
+static struct pfile pf_ct_max      = { .name = "/proc/sys/net/netfilter/nf_conntrack_max", .fd = -1 };
+
+static struct pfile pf_pressure[PSI_RES] = {
+	[PSI_CPU]    = { .name = "/proc/pressure/cpu",    .fd = -1 },
+	[PSI_MEMORY] = { .name = "/proc/pressure/memory", .fd = -1 },
+	[PSI_IO]     = { .name = "/proc/pressure/io",     .fd = -1 },
+};
+
+/* the shared sources and the values of their last read */
+static struct source src_netdev, src_stat, src_uptime, src_interrupts, src_disks;
+static struct source src_pressure[PSI_RES], src_loadavg, src_conntrack;
+static unsigned int psi_avg10[PSI_RES]; /* in hundredths of percent */
+static unsigned int loadavg1, loadavg_run; /* 1 min load in hundredths, runnable tasks */
+static unsigned int nb_online;             /* online CPUs, 0 = not known yet */
+static unsigned int ct_count, ct_max;      /* conntrack entries and limit */
+static struct cpu_sample *stat_cpus; /* [0]=all CPUs, [1+n]=CPU n */
+static int stat_nbcpu;
+static int stat_cores;               /* per CPU lines are needed */
+static unsigned int uptime_total, uptime_idle;
+
+/* A device name pattern whose interrupts are counted from /proc/interrupts,
+ * shared by all the leds using it.
+ */
+struct irq_pat {
+	const char *pattern;  /* shell pattern of device names */
+	unsigned int count;   /* interrupts of the matching lines at the last read */
+};
+
+/* A line of /proc/interrupts known to match pattern <pat>. Once the matching
+ * lines are known, the other ones are skipped without being tokenized. The
+ * IRQ number is checked to detect changes in the file.
+ */
+struct irq_line {
+	int line;             /* line number in the file */
+	unsigned int irq;
+	int pat;              /* entry of irq_pats[] */
+};
+
+/* maximum number of words parsed after the counters of an interrupt line */
+#define IRQ_MAXWORDS 8
+
+static struct irq_pat *irq_pats;
+static int nb_irq_pats;
+static struct irq_line *irq_lines; /* sorted by line number */
+static int nb_irq_lines;
+static int irq_nblines;            /* lines in the file, 0 = irq_lines[] unknown */
+static struct disk_dev *disk_devs;
+static int nb_disk_devs;
+
+/* returns non-zero if source <src> was not read during the current period.
+ * The age is an unsigned difference so that a source left unread for more
+ * than half of the clock's wrapping period is not taken as fresh.
+ */
+static inline int src_stale(const struct source *src)
+{
+	return !src->seq || now - src->date >= SAMPLE_PERIOD;
+}
+
+/* records a new read of source <src> */
+static inline void src_read(struct source *src)
+{
+	src->seq++;
+	src->date = now;
+}
+
+#ifdef DEBUG
+static unsigned int pf_saved; /* number of open/close syscalls saved */
+static unsigned int pf_last_report;
+#endif
+
+/* read up to <size> bytes from file <pf> at offset <ofs> into <buffer>. The
+ * file is opened on first use and kept open. If a read fails, the file is
+ * reopened once and the read retried. Returns the number of bytes read, zero
+ * at the end of file, or <0 on error.
  */
-static int readfile(const char *name, char *buffer, int size)
+static int pf_pread(struct pfile *pf, char *buffer, int size, off_t ofs)
 {
-	int fd, ret;
-	char *orig;
+	int ret, retry;
+
+	for (retry = 0; retry < 2; retry++) {
+		if (pf->fd < 0) {
+			pf->fd = open(pf->name, O_RDONLY);
+			if (pf->fd < 0)
+				return pf->fd;
+#ifdef USE_STATS
+			pf->opens++;
+#endif
+		}
+#ifdef DEBUG
+		else if (!ofs)
+			pf_saved += 2;
+#endif
+#ifdef USE_STATS
+		pf->reads++;
+#endif
+		ret = pread(pf->fd, buffer, size, ofs);
+		if (ret >= 0)
+			break;
 
-	fd = ret = open(name, O_RDONLY);
-	if (ret < 0)
-		goto out;
+		/* read error, the file will be reopened */
+		close(pf->fd);
+		pf->fd = -1;
+	}
+
+#ifdef DEBUG
+	if (!ofs && !date_before(now, pf_last_report + 60 * SLEEP_1SEC)) {
+		printf("readfile: %u syscalls saved during last minute\n", pf_saved);
+		pf_saved = 0;
+		pf_last_report = now;
+	}
+#endif
+	return ret;
+}
+
+/* read the maximum of file <pf> into <buffer>, but not more than <size>
+ * bytes. A terminating zero is always added after a read succeeds. The zero
+ * lies within <size> but is not counted in the return value. The number of
+ * bytes read is returned. Zero is returned if the file was empty, <0 is
+ * returned in case of any error.
+ */
+static int readfile(struct pfile *pf, char *buffer, int size)
+{
+	int ret, len = 0;
 
-	orig = buffer;
 	do {
-		ret = read(fd, buffer, size);
+		ret = pf_pread(pf, buffer + len, size - len, len);
 		if (ret < 0)
-			goto out_close;
-		if (ret == 0)
-			break;
-		size -= ret;
-		buffer += ret;
-	} while (size > 0);
+			return ret;
+		len += ret;
+	} while (ret && len < size);
 
 	/* we always want to stuff the terminating zero, even if that implies
 	 * to truncate the result.
 	 */
-	if (!size)
-		buffer--;
-	ret = buffer - orig;
-	*buffer = 0;
-
- out_close:
-	close(fd);
- out:
-	return ret;
+	if (len == size)
+		len--;
+	buffer[len] = 0;
+	return len;
+}
+
+/* read file <pf> into the trash buffer and call <parse> for each line with
+ * <ctx>. The line passed to <parse> is zero-terminated and does not contain
+ * the LF anymore, and may be modified. <parse> returns non-zero to stop
+ * reading the file when it does not need the rest. Files larger than the
+ * trash are read in multiple chunks, and the trash is grown for next reads so
+ * that common files are read at once. Lines larger than the trash are
+ * truncated. The number of bytes read is returned, or <0 if any error.
+ */
+static int readlines(struct pfile *pf, int (*parse)(char *, void *), void *ctx)
+{
+	int ofs = 0;  /* file offset of the next read */
+	int len = 0;  /* bytes pending at the beginning of the trash */
+	int skip = 0; /* skipping the end of a truncated line */
+	char *line, *end;
+	int ret;
+
+	while (1) {
+		ret = pf_pread(pf, trash + len, trash_size - 1 - len, ofs);
+		if (ret < 0)
+			return ret;
+
+		ofs += ret;
+		len += ret;
+		trash[len] = 0;
+
+		line = trash;
+		while ((end = memchr(line, '\n', trash + len - line)) != NULL) {
+			*end = 0;
+			if (!skip && parse(line, ctx))
+				return ofs;
+			skip = 0;
+			line = end + 1;
+		}
+
+		if (!ret) {
+			/* end of file, there may be an unterminated last line */
+			if (line < trash + len && !skip)
+				parse(line, ctx);
+			break;
+		}
+
+		len = trash + len - line;
+		if (len == trash_size - 1) {
+			/* line larger than the trash, report it truncated */
+			if (!skip && parse(trash, ctx))
+				return ofs;
+			skip = 1;
+			len = 0;
+		}
+		else
+			memmove(trash, line, len);
+	}
+
+	/* make the trash large enough for this file next time */
+	if (ofs >= trash_size && trash_size < TRASH_MAX) {
+		int size = trash_size;
+		char *new;
+
+		while (size <= ofs && size < TRASH_MAX)
+			size *= 2;
+		new = realloc(trash, size);
+		if (new) {
+			trash = new;
+			trash_size = size;
+		}
+	}
+	return ofs;
 }
 
 /* if ret < 0, report msg with perror and return -ret.
@@ -350,373 +940,2281 @@ static inline const char *ultoa_r(unsigned long n, char *buffer, int size)
 	return pos + 1;
 }
 
-/* return next line of buffer <buffer> after <start>, which may hold last
- * return value. On first call, <start> must be NULL so that the beginning of
- * <buffer> is returned first. When end of buffer is reached (\0), NULL is
- * returned. The caller must be careful about setting <start> after any \0 if
- * it truncates strings.
- */
-static char *nextline(char *buffer, char *start)
+/* place task at position <pos> in the heap */
+static inline void task_place(struct task *t, int pos)
 {
-	if (start)
-		while (*start && *(start++) != '\n');
-	else
-		start = buffer;
+	tasks[pos] = t;
+	t->heap = pos;
+}
 
-	if (!*start)
-		return NULL;
-	return start;
+/* move task <t> up or down the heap until it's at the right place */
+static void task_sift(struct task *t)
+{
+	int pos = t->heap;
+	int child;
+
+	while (pos > 0 && date_before(t->expire, tasks[(pos - 1) / 2]->expire)) {
+		task_place(tasks[(pos - 1) / 2], pos);
+		pos = (pos - 1) / 2;
+	}
+
+	while ((child = pos * 2 + 1) < nbtasks) {
+		if (child + 1 < nbtasks &&
+		    date_before(tasks[child + 1]->expire, tasks[child]->expire))
+			child++;
+		if (!date_before(tasks[child]->expire, t->expire))
+			break;
+		task_place(tasks[child], pos);
+		pos = child;
+	}
+	task_place(t, pos);
 }
 
-/* return a pointer to a struct if_status already existing or just
- * created matching this interface name. NULL is returned if the
- * interface does not exist and cannot be created. The name pointer
- * is just copied, so the caller must allocate it if required. If
- * the interface already exists, its checks may be completed.
+/* queue task <t> according to its expire date, or requeue it if it was
+ * already queued. The heap is grown if needed.
  */
-static inline struct if_status *getif(const char *name, int check)
+static void task_queue(struct task *t)
 {
-	struct if_status *i;
-
-	for (i = ifs; i < ifs + nbifs; i++) {
-		if (strcmp(name, i->name) == 0) {
-			i->check |= check;
-			return i;
+	if (t->heap < 0) {
+		if (nbtasks >= maxtasks) {
+			maxtasks = maxtasks ? maxtasks * 2 : 8;
+			tasks = realloc(tasks, maxtasks * sizeof(*tasks));
+			if (!tasks)
+				exit(1);
 		}
+		t->heap = nbtasks++;
 	}
+	task_sift(t);
+}
 
-	if (nbifs >= MAXIFS)
-		return NULL;
-
-	i->name = name;
-	i->check = check;
-	nbifs++;
+/* remove task <t> from the heap if it was there */
+static void task_unqueue(struct task *t)
+{
+	int pos = t->heap;
 
-	return i;
+	if (pos < 0)
+		return;
+	t->heap = -1;
+	if (pos == --nbtasks)
+		return;
+	task_place(tasks[nbtasks], pos);
+	task_sift(tasks[pos]);
 }
 
-/* return a new struct if_list pointing to device <name> which may be
- * allocated on the fly. The if_list element is inserted before <prev>.
- * In case of lack of resource, NULL is returned.
+/* queue task <t> to expire <delay> microseconds after its previous expire
+ * date, so that processing time and late wakeups do not make the delays
+ * drift. If the resulting date is already in the past (eg: we were stopped),
+ * the task is resynchronized on the current date.
  */
-struct if_list *newif(const char *name, int check, struct if_list *prev)
+static void task_schedule(struct task *t, unsigned int delay)
 {
-	struct if_status *i;
-	struct if_list *l;
+	t->expire += delay;
+	if (date_before(t->expire, now))
+		t->expire = now;
+	task_queue(t);
+}
 
-	i = getif(name, check);
-	if (!i || nbifl >= MAXIFL)
-		return NULL;
+/* registers event handler <h> to be called when <fd> is readable or reports
+ * a priority event (eg: PSI triggers). Returns <0 on error.
+ */
+static int ev_register(struct evh *h, int fd, void (*iocb)())
+{
+	struct epoll_event ev;
 
-	l = &ifl[nbifl];
-	nbifl++;
-	l->next = prev;
-	l->ifs = i;
-	return l;
+	h->fd = fd;
+	h->iocb = iocb;
+	ev.events = EPOLLIN | EPOLLPRI;
+	ev.data.ptr = h;
+	return epoll_ctl(ep_fd, EPOLL_CTL_ADD, fd, &ev);
 }
 
-/* Check if at least one interface is up in the list <l>, which can be NULL,
- * according to checks defined by <check>. If this is the case, <flag> is
- * returned.
- */
-unsigned int check_if_list(struct if_list *l, unsigned int check, unsigned int flag)
+/* acknowledges the timer expiration */
+static void timer_expired()
 {
-	unsigned int ret = 0;
+	unsigned long long ticks;
 
-	if (!l)
-		return flag;
+	read(timer_evh.fd, &ticks, sizeof(ticks));
+	timer_armed = 0;
 
-	do {
-		if ((l->ifs->status & check) == check)
-			ret |= flag;
-		if (l->prev_status != l->ifs->status) {
-			l->prev_status = l->ifs->status;
-			ret |= LINK_CHANGED;
-		}
-		l = l->next;
-	} while (l);
+#ifdef USE_STATS
+	{
+		unsigned int late = now - timer_date;
+		int b;
 
-	return ret;
+		if ((int)late < 0)
+			late = 0;
+		for (b = 0; b < sizeof(late_bounds)/sizeof(late_bounds[0]); b++)
+			if (late < late_bounds[b])
+				break;
+		stats.late[b]++;
+		if (late > stats.late_max)
+			stats.late_max = late;
+		stats.timer_wakeups++;
+		stats.timer_calls++;
+	}
+#endif
 }
 
-/* return link status for interface <dev> using socket <sock>.
- * return 0 if down, 1 if up, -1 if any error (check errno).
+/* returns the date at which the daemon should wake up to process a task
+ * expiring at <date>. It's the date itself unless the low power mode is set,
+ * in which case it's rounded up to the next grid point.
  */
-int glink(int sock, const char *dev)
+static inline unsigned int wakeup_date(unsigned int date)
 {
-	struct ifreq ifr;
-	struct ethtool_value edata;
-
-	memset(&ifr, 0, sizeof(ifr));
-	strncpy(ifr.ifr_name, dev, sizeof(ifr.ifr_name)-1);
-
-	edata.cmd = ETHTOOL_GLINK;
-	ifr.ifr_data = (void *)&edata;
-	if (ioctl(sock, SIOCETHTOOL, &ifr) != 0)
-		return -1;
+	unsigned int ofs;
 
-	return edata.data ? 1 : 0;
+	if (!grid)
+		return date;
+	ofs = (date - grid_base) % grid;
+	return ofs ? date - ofs + grid : date;
 }
 
-/* return 1 if interface <dev> is up, otherwise 0. */
-int if_up(int sock, const char *dev)
+/* arms the timer to expire at <date> unless it's already armed for this
+ * date. A relative delay is used since the date is truncated, but it's
+ * computed from the current date so that it does not drift.
+ */
+static void timer_arm(unsigned int date)
 {
-	struct ifreq ifr;
+	struct itimerspec its;
+	int delay;
 
-	memset(&ifr, 0, sizeof(ifr));
-	strncpy(ifr.ifr_name, dev, sizeof(ifr.ifr_name)-1);
+	date = wakeup_date(date);
+	if (timer_armed && date == timer_date)
+		return;
 
-	if (ioctl(sock, SIOCGIFFLAGS, &ifr) != 0)
-		return 0;
-	return (ifr.ifr_flags & IFF_UP) ? 1 : 0;
+	delay = date - get_date();
+	if (delay <= 0)
+		delay = 1;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = delay / 1000000;
+	its.it_value.tv_nsec = (delay % 1000000) * 1000;
+	timerfd_settime(timer_evh.fd, 0, &its, NULL);
+	STATS_INC(timer_calls);
+	timer_date = date;
+	timer_armed = 1;
 }
 
-/* Check in /proc/net/dev for the presence of all devices declared in ifs[],
- * as well as their status, depending on ->check. The ->status field is
- * updated to reflect the checks which succeeded. Note that it is not permitted
- * anymore to have several interfaces with the same name. It is important to
- * check for device existence before querying it, because it avoids the
- * automatic modprobe the system may do for absent devices.
+/* initialize task <t> to call <process> with <context>, and queue it to be
+ * woken up immediately.
  */
-void check_if_status()
+static void task_init(struct task *t, void (*process)(struct task *), void *context)
 {
-	int if_num;
-	char *line;
+	t->process = process;
+	t->context = context;
+	t->heap = -1;
+	t->expire = now;
+	task_queue(t);
+}
 
-	for (if_num = 0; if_num < nbifs; if_num++)
-		ifs[if_num].status = IF_CHECK_NONE;
+/* allocates the arena for up to <max> interfaces and as many interface list
+ * elements and patterns. Returns 0 if the memory is missing.
+ */
+static int if_alloc(int max)
+{
+	unsigned int size = 1;
+	char *arena;
 
-	if (readfile("/proc/net/dev", trash, sizeof(trash)) <= 0)
-		return;
+	while (size < 2 * max)
+		size <<= 1;
 
-	line = NULL;
-	while ((line = nextline(trash, line)) != NULL) {
-		char *name;
+	arena = calloc(1, size * sizeof(*if_hash) +
+	               max * (sizeof(*ifs) + sizeof(*ifl) + sizeof(*ifp)));
+	if (!arena)
+		return 0;
 
-		while (isspace(*line))
-			line++;
-		name = line;
+	if_hash = (struct if_status **)arena;
+	if_hash_mask = size - 1;
+	ifs = (struct if_status *)(if_hash + size);
+	ifl = (struct if_list *)(ifs + max);
+	ifp = (struct if_pattern *)(ifl + max);
+	maxifs = maxifl = max;
+	return 1;
+}
+
+/* returns the hash bucket of interface <name> */
+static inline struct if_status **if_bucket(const char *name)
+{
+	unsigned int hash = 0;
+
+	while (*name)
+		hash = hash * 31 + (unsigned char)*name++;
+	return &if_hash[hash & if_hash_mask];
+}
+
+/* inserts interface <i> into the hash table, which is grown first if it would
+ * hold more names than buckets. The table is kept as is if the memory is
+ * missing.
+ */
+static void if_hash_add(struct if_status *i)
+{
+	struct if_status **bucket, **old = if_hash;
+	struct if_status *cur, *next;
+	unsigned int size = if_hash_mask + 1;
+	unsigned int b;
+
+	if (++if_hashed > size) {
+		if_hash = calloc(2 * size, sizeof(*if_hash));
+		if (if_hash) {
+			if_hash_mask = 2 * size - 1;
+			for (b = 0; b < size; b++) {
+				for (cur = old[b]; cur; cur = next) {
+					next = cur->hnext;
+					bucket = if_bucket(cur->name);
+					cur->hnext = *bucket;
+					*bucket = cur;
+				}
+			}
+			if (if_hash_grown)
+				free(old);
+			if_hash_grown = 1;
+		}
+		else
+			if_hash = old;
+	}
+
+	bucket = if_bucket(i->name);
+	i->hnext = *bucket;
+	*bucket = i;
+}
+
+/* looks up interface <name> among the tracked ones. Returns NULL if it is
+ * not tracked.
+ */
+static struct if_status *findif(const char *name)
+{
+	struct if_status *i;
+
+	for (i = *if_bucket(name); i; i = i->hnext)
+		if (strcmp(name, i->name) == 0)
+			return i;
+	return NULL;
+}
+
+/* tracks interface <i> with the checks of pattern <p>, and inserts it into
+ * the pattern's LED list if any and if not already there, so that it is not
+ * counted twice. Returns 0 if the memory is missing.
+ */
+static int if_link(struct if_status *i, struct if_pattern *p)
+{
+	struct if_list *l;
+
+	i->check = (i->check & ~IF_CHECK_IGNORE) | p->check;
+	if (!p->list)
+		return 1;
+
+	for (l = p->list->next; l; l = l->next)
+		if (l->ifs == i)
+			return 1;
+
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return 0;
+	l->ifs = i;
+	l->next = p->list->next;
+	p->list->next = l;
+	return 1;
+}
+
+/* return a pointer to a struct if_status already existing or just
+ * created matching this interface name. NULL is returned if the
+ * interface does not exist and cannot be created. The name pointer
+ * is just copied, so the caller must allocate it if required. If
+ * the interface already exists, its checks may be completed. A new
+ * interface is also linked to the patterns it matches.
+ */
+static inline struct if_status *getif(const char *name, int check)
+{
+	struct if_status *i;
+	int p;
+
+	i = findif(name);
+	if (i) {
+		i->check |= check;
+		return i;
+	}
+
+	if (nbifs >= maxifs)
+		return NULL;
+
+	i = &ifs[nbifs++];
+	i->name = name;
+	i->check = check;
+	if_hash_add(i);
+	i->next = if_tracked;
+	if_tracked = i;
+
+	for (p = 0; p < nbifp; p++)
+		if (fnmatch(ifp[p].pattern, name, 0) == 0 && !if_link(i, &ifp[p]))
+			return NULL;
+	return i;
+}
+
+/* registers pattern <pattern> for interfaces to be tracked with <check>,
+ * and inserted after list element <list> if not NULL. The interfaces already
+ * named on the command line are linked to it immediately. Returns NULL if
+ * there is no more room.
+ */
+static struct if_pattern *newpattern(const char *pattern, int check, struct if_list *list)
+{
+	struct if_pattern *p;
+	int i;
+
+	if (nbifp >= maxifs)
+		return NULL;
+
+	p = &ifp[nbifp++];
+	p->pattern = pattern;
+	p->check = check;
+	p->list = list;
+
+	for (i = 0; i < nbifs; i++)
+		if (fnmatch(pattern, ifs[i].name, 0) == 0 && !if_link(&ifs[i], p))
+			return NULL;
+	return p;
+}
+
+/* returns the tracked interface <name>. If the name was never seen, it is
+ * matched against the patterns, and tracked if any matches. The names which
+ * do not match are remembered as well, so that patterns are only evaluated
+ * when a new name appears and not on every poll. Names are marked as seen
+ * each time they are looked up, for if_sweep(). Returns NULL if the interface
+ * is not tracked.
+ */
+static struct if_status *matchif(const char *name)
+{
+	struct if_status *i;
+	int p;
+
+	i = findif(name);
+	if (i)
+		i->seen = 1;
+	if (i || !nbifp)
+		return (i && !(i->check & IF_CHECK_IGNORE)) ? i : NULL;
+
+	i = calloc(1, sizeof(*i) + strlen(name) + 1);
+	if (!i)
+		return NULL;
+	i->name = strcpy((char *)(i + 1), name);
+	i->check = IF_CHECK_IGNORE;
+	i->seen = 1;
+
+	for (p = 0; p < nbifp; p++)
+		if (fnmatch(ifp[p].pattern, name, 0) == 0)
+			if_link(i, &ifp[p]);
+
+	if_hash_add(i);
+	if (i->check & IF_CHECK_IGNORE)
+		return NULL;
+
+	i->check |= IF_CHECK_DYNAMIC;
+	i->next = if_tracked;
+	if_tracked = i;
+	return i;
+}
+
+/* frees interface <i> which matched no pattern or was discovered from one,
+ * after unlinking it from the hash table, the tracked interfaces and the LED
+ * lists. The pattern's element of these lists then reports a change once.
+ */
+static void if_free(struct if_status *i)
+{
+	struct if_status **pi;
+	struct if_list **pl, *l;
+	int p;
+
+	for (pi = if_bucket(i->name); *pi != i; pi = &(*pi)->hnext)
+		;
+	*pi = i->hnext;
+	if_hashed--;
+
+	if (i->check & IF_CHECK_DYNAMIC) {
+		for (pi = &if_tracked; *pi != i; pi = &(*pi)->next)
+			;
+		*pi = i->next;
+
+		for (p = 0; p < nbifp; p++) {
+			if (!ifp[p].list)
+				continue;
+			pl = &ifp[p].list->next;
+			while ((l = *pl) != NULL) {
+				if (l->ifs != i) {
+					pl = &l->next;
+					continue;
+				}
+				*pl = l->next;
+				free(l);
+				ifp[p].list->prev_status = -1;
+			}
+		}
+	}
+	free(i);
+}
+
+/* forgets interface <name> if it matched no pattern or was discovered from
+ * one. Named interfaces are always kept.
+ */
+static void if_forget(const char *name)
+{
+	struct if_status *i = findif(name);
+
+	if (i && (i->check & (IF_CHECK_IGNORE | IF_CHECK_DYNAMIC)))
+		if_free(i);
+}
+
+/* forgets the interfaces which matched no pattern or were discovered from
+ * one, and were not seen since the last call, so that the names of the
+ * interfaces which disappeared do not pile up.
+ */
+static void if_sweep()
+{
+	struct if_status *i, *next;
+	unsigned int b;
+
+	for (b = 0; b <= if_hash_mask; b++) {
+		for (i = if_hash[b]; i; i = next) {
+			next = i->hnext;
+			if (!(i->check & (IF_CHECK_IGNORE | IF_CHECK_DYNAMIC)))
+				continue;
+			if (i->seen)
+				i->seen = 0;
+			else
+				if_free(i);
+		}
+	}
+}
+
+/* return a new struct if_list pointing to device <name> which may be
+ * allocated on the fly. The if_list element is inserted before <prev>,
+ * which is returned as is if it already lists the device.
+ * In case of lack of resource, NULL is returned.
+ */
+struct if_list *newif(const char *name, int check, struct if_list *prev)
+{
+	struct if_status *i;
+	struct if_list *l;
+
+	if (nbifl >= maxifl)
+		return NULL;
+
+	l = &ifl[nbifl];
+	l->next = prev;
+	if (strpbrk(name, IF_PATTERN_CHARS)) {
+		/* the pattern's element reports an absent interface */
+		l->ifs = &if_pattern_status;
+		if (!newpattern(name, check, l))
+			return NULL;
+	}
+	else {
+		i = getif(name, check);
+		if (!i)
+			return NULL;
+		/* it may already be listed from a pattern */
+		while (prev && prev->ifs != i)
+			prev = prev->next;
+		if (prev)
+			return l->next;
+		l->ifs = i;
+	}
+	nbifl++;
+	return l;
+}
+
+/* Check if at least one interface is up in the list <l>, which can be NULL,
+ * according to checks defined by <check>. If this is the case, <flag> is
+ * returned.
+ */
+unsigned int check_if_list(struct if_list *l, unsigned int check, unsigned int flag)
+{
+	unsigned int ret = 0;
+
+	if (!l)
+		return flag;
+
+	do {
+		if ((l->ifs->status & check) == check)
+			ret |= flag;
+		if (l->prev_status != l->ifs->status) {
+			l->prev_status = l->ifs->status;
+			ret |= LINK_CHANGED;
+		}
+		l = l->next;
+	} while (l);
+
+	return ret;
+}
+
+/* return link status for interface <dev> using socket <sock>.
+ * return 0 if down, 1 if up, -1 if any error (check errno).
+ */
+int glink(int sock, const char *dev)
+{
+	struct ifreq ifr;
+	struct ethtool_value edata;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev, sizeof(ifr.ifr_name)-1);
+
+	edata.cmd = ETHTOOL_GLINK;
+	ifr.ifr_data = (void *)&edata;
+	STATS_INC(net_ioctls);
+	if (ioctl(sock, SIOCETHTOOL, &ifr) != 0)
+		return -1;
+
+	return edata.data ? 1 : 0;
+}
+
+/* return the link speed of interface <dev> in Mb/s using socket <sock>, or 0
+ * if unknown.
+ */
+unsigned int gspeed(int sock, const char *dev)
+{
+	struct ifreq ifr;
+	struct ethtool_speed edata;
+	unsigned int speed;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev, sizeof(ifr.ifr_name)-1);
+
+	memset(&edata, 0, sizeof(edata));
+	edata.cmd = ETHTOOL_GSET;
+	ifr.ifr_data = (void *)&edata;
+	STATS_INC(net_ioctls);
+	if (ioctl(sock, SIOCETHTOOL, &ifr) != 0)
+		return 0;
+
+	speed = (edata.speed_hi << 16) | edata.speed;
+	return (speed == 0xFFFF || speed == 0xFFFFFFFF) ? 0 : speed;
+}
+
+/* return 1 if interface <dev> is up, otherwise 0. */
+int if_up(int sock, const char *dev)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev, sizeof(ifr.ifr_name)-1);
+
+	STATS_INC(net_ioctls);
+	if (ioctl(sock, SIOCGIFFLAGS, &ifr) != 0)
+		return 0;
+	return (ifr.ifr_flags & IFF_UP) ? 1 : 0;
+}
+
+/* parses one line of /proc/net/dev. If the interface is tracked, its
+ * counters are collected if needed, and it is marked as present if <ctx>
+ * points to a non-zero integer.
+ */
+static int parse_netdev_line(char *line, void *ctx)
+{
+	unsigned int v[16];
+	int n;
+	struct if_status *i;
+	char *name;
+
+	while (isspace(*line))
+		line++;
+	name = line;
+
+	while (*line && !isspace(*line) && *line != ':')
+		line++;
+
+	/* if line points to ':', we have a name before it */
+	if (*line != ':')
+		return 0;
+	*(line++) = 0;
+
+	i = matchif(name);
+	if (!i)
+		return 0;
+
+	if (*(int *)ctx)
+		i->status = IF_CHECK_PRESENT;
+
+	if (i->check & IF_CHECK_COUNTERS) {
+		/* 8 rx then 8 tx counters, bytes first, may exceed 32 bits */
+		for (n = 0; n < 16 && *line; n++)
+			v[n] = strtoull(line, &line, 10);
+		if (n == 16) {
+			i->bytes = v[0] + v[8];
+			i->errors = v[2] + v[3] + v[4] + v[10] + v[11] + v[12];
+		}
+	}
+	return 0;
+}
+
+/* reads /proc/net/dev once to collect the counters of the tracked interfaces
+ * and their presence if <presence> is non-zero, in which case the discovered
+ * interfaces and untracked names which disappeared are forgotten. Returns the
+ * number of bytes read or <=0 on error.
+ */
+static int read_netdev(int presence)
+{
+	int ret;
+
+	ret = readlines(&pf_netdev, parse_netdev_line, &presence);
+	if (ret > 0)
+		src_read(&src_netdev);
+	if (ret > 0 && presence && nbifp)
+		if_sweep();
+	return ret;
+}
+
+/* Check in /proc/net/dev for the presence of all tracked devices,
+ * as well as their status, depending on ->check. The ->status field is
+ * updated to reflect the checks which succeeded. Note that it is not permitted
+ * anymore to have several interfaces with the same name. It is important to
+ * check for device existence before querying it, because it avoids the
+ * automatic modprobe the system may do for absent devices.
+ */
+void check_if_status()
+{
+	struct if_status *i;
+
+	for (i = if_tracked; i; i = i->next)
+		i->status = IF_CHECK_NONE;
+
+	if (read_netdev(1) <= 0)
+		return;
+
+	/* update all interfaces status according to the declared checks */
+	for (i = if_tracked; i; i = i->next) {
+		if (i->status & IF_CHECK_PRESENT) {
+			if (!(i->check & IF_CHECK_LOGICAL) ||
+			    if_up(net_sock, i->name))
+				i->status |= IF_CHECK_LOGICAL;
+	
+			if (!(i->check & IF_CHECK_PHYSICAL) ||
+			    (glink(net_sock, i->name) == 1))
+				i->status |= IF_CHECK_PHYSICAL;
+		}
+	}
+}
+
+/* Opens an rtnetlink socket subscribed to link events. Returns the socket or
+ * <0 if not supported, in which case the caller should fall back to polling.
+ */
+static int nl_open()
+{
+	struct sockaddr_nl addr;
+	int sock;
+
+	sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (sock < 0)
+		return sock;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* Updates the status of interface <i> from a link message of type <type>
+ * reporting interface flags <flags>. Returns non-zero if the status changed.
+ */
+static int nl_update_if(struct if_status *i, int type, unsigned int flags)
+{
+	int status = IF_CHECK_NONE;
+
+	if (type == RTM_NEWLINK) {
+		status = IF_CHECK_PRESENT;
+		if (!(i->check & IF_CHECK_LOGICAL) || (flags & IFF_UP))
+			status |= IF_CHECK_LOGICAL;
+		if (!(i->check & IF_CHECK_PHYSICAL) ||
+		    ((flags & (IFF_UP|IFF_LOWER_UP)) == (IFF_UP|IFF_LOWER_UP)))
+			status |= IF_CHECK_PHYSICAL;
+	}
+
+	if (status == i->status)
+		return 0;
+	i->status = status;
+	return 1;
+}
+
+/* Reads all pending messages from the rtnetlink socket and updates the
+ * tracked interfaces accordingly. In case of overflow, some events were lost
+ * so the whole status is polled once. Returns non-zero if any status changed.
+ */
+static int nl_recv()
+{
+	char buf[8192];
+	struct nlmsghdr *nlh;
+	int changed = 0;
+	int len;
+
+	while (1) {
+		len = recv(nl_sock, buf, sizeof(buf), MSG_DONTWAIT);
+		STATS_INC(nl_reads);
+		if (len < 0) {
+			if (errno == ENOBUFS) {
+				check_if_status();
+				changed = 1;
+				continue;
+			}
+			break;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+			struct rtattr *rta;
+			struct if_status *i;
+			int rtl;
+
+			if (nlh->nlmsg_type != RTM_NEWLINK && nlh->nlmsg_type != RTM_DELLINK)
+				continue;
+
+			rtl = IFLA_PAYLOAD(nlh);
+			for (rta = IFLA_RTA(ifi); RTA_OK(rta, rtl); rta = RTA_NEXT(rta, rtl)) {
+				if (rta->rta_type != IFLA_IFNAME)
+					continue;
+				i = matchif(RTA_DATA(rta));
+				if (i)
+					changed |= nl_update_if(i, nlh->nlmsg_type, ifi->ifi_flags);
+				if (nlh->nlmsg_type == RTM_DELLINK)
+					if_forget(RTA_DATA(rta));
+				break;
+			}
+		}
+	}
+	return changed;
+}
+
+/* parses one line of /proc/stat into stat_cpus[]. Reading stops after the
+ * last CPU line, or after the first one when no led needs the per CPU lines.
+ */
+static int parse_stat_line(char *line, void *ctx)
+{
+	struct cpu_sample *cur;
+	unsigned int total, idle, val;
+	int num, field;
+
+	/* format :
+	 * cpu[N] user nice system idle iowait irq softirq steal guest guest_nice
+	 */
+	if (strncmp(line, "cpu", 3) != 0)
+		return 1;
+	line += 3;
+
+	num = 0;
+	if (isdigit(*line)) {
+		if (!stat_cores)
+			return 1;
+		num = atoi(line) + 1;
+	}
+
+	if (num >= stat_nbcpu) {
+		cur = realloc(stat_cpus, (num + 1) * sizeof(*cur));
+		if (!cur)
+			return 1;
+		memset(cur + stat_nbcpu, 0, (num + 1 - stat_nbcpu) * sizeof(*cur));
+		stat_cpus = cur;
+		stat_nbcpu = num + 1;
+	}
+	cur = &stat_cpus[num];
+
+	/* sum the first 8 fields, guest times are already accounted in user */
+	total = idle = 0;
+	for (field = 0; field < 8; field++) {
+		while (*line == ' ')
+			line++;
+		if (!isdigit(*line))
+			break;
+		val = 0;
+		do {
+			val = val * 10 + *line - '0';
+		} while (isdigit(*++line));
+
+		total += val;
+		if (field == 3 || field == 4) /* idle and iowait */
+			idle += val;
+	}
+
+	cur->total = total;
+	cur->idle  = idle;
+	return 0;
+}
+
+/* reads /proc/stat unless it was already read during this period. Returns 0
+ * on error.
+ */
+static int read_stat()
+{
+	if (!src_stale(&src_stat))
+		return 1;
+	if (readlines(&pf_stat, parse_stat_line, NULL) <= 0)
+		return 0;
+	src_read(&src_stat);
+	return 1;
+}
+
+/* retrieve CPU usage from /proc/stat according to the led's aggregation mode
+ * and update the led's cpu_usage. Return 0 if any error, or 1 if values were
+ * updated.
+ */
+int update_cpu_stat(struct led *led)
+{
+	struct cpu_status *cpu = &led->cpu;
+	struct cpu_sample *cur, *prev;
+	unsigned int usage, max = 0;
+	unsigned int total, idle;
+	int num, first, last;
+
+	if (cpu->mode != CPU_MEAN)
+		stat_cores = 1;
+	if (!read_stat())
+		return 0;
+	if (cpu->seq == src_stat.seq)
+		return 1;
+	cpu->seq = src_stat.seq;
+
+	if (cpu->nbcpu < stat_nbcpu) {
+		prev = realloc(cpu->prev, stat_nbcpu * sizeof(*prev));
+		if (!prev)
+			return 0;
+		memset(prev + cpu->nbcpu, 0, (stat_nbcpu - cpu->nbcpu) * sizeof(*prev));
+		cpu->prev = prev;
+		cpu->nbcpu = stat_nbcpu;
+	}
+
+	first = last = 0;
+	if (cpu->mode == CPU_MAX) {
+		first = 1;
+		last = stat_nbcpu - 1;
+	}
+	else if (cpu->mode >= CPU_CORE)
+		first = last = cpu->mode - CPU_CORE + 1;
+
+	for (num = first; num <= last && num < stat_nbcpu; num++) {
+		cur  = &stat_cpus[num];
+		prev = &cpu->prev[num];
+
+		total = cur->total - prev->total;
+		idle  = cur->idle - prev->idle;
+
+		/* idle includes iowait which may go backwards on a CPU */
+		if ((int)idle < 0)
+			idle = 0;
+		if (idle > total)
+			idle = total;
+
+		/* skip the first sample and those where the total went backwards */
+		if (prev->total && (int)total > 0) {
+			usage = (total - idle) * 100 / total;
+			if (usage > max)
+				max = usage;
+		}
+		*prev = *cur;
+	}
+	cpu->cpu_usage = max;
+	return 1;
+}
+
+/* reads /proc/uptime unless it was already read during this period. Returns
+ * 0 on error.
+ */
+static int read_uptime()
+{
+	char *ptr;
+	unsigned int total, idle;
+
+	if (!src_stale(&src_uptime))
+		return 1;
+	if (readfile(&pf_uptime, trash, trash_size) <= 0)
+		return 0;
+
+	/* format : 
+	 * cpu_total_sec.centisec cpu_idle_sec.centisec
+	 */
+
+	total = 0;
+	ptr = trash;
+	while (*ptr && *ptr != ' ') {
+		if (isdigit(*ptr)) /* ignore dot */
+			total = total*10 + *ptr - '0';
+		ptr++;
+	}
+
+	while (isspace(*ptr))
+		ptr++;
+
+	idle = 0;
+	while (*ptr && *ptr != '\n') {
+		if (isdigit(*ptr)) /* ignore dot */
+			idle = idle*10 + *ptr - '0';
+		ptr++;
+	}
+
+	uptime_total = total;
+	uptime_idle = idle;
+	src_read(&src_uptime);
+	return 1;
+}
+
+/* retrieve CPU usage from /proc/uptime, and update cpu_total[] and cpu_idle[].
+ * Return 0 if any error, or 1 if values were updated.
+ */
+int update_cpu(struct led *led)
+{
+	unsigned int total, idle;
+
+	if (!read_uptime())
+		return 0;
+	if (uptime_total == led->cpu.cpu_total[1])
+		return 1;
+
+	led->cpu.cpu_total[0] = led->cpu.cpu_total[1];
+	led->cpu.cpu_total[1] = uptime_total;
+	led->cpu.cpu_idle[0] = led->cpu.cpu_idle[1];
+	led->cpu.cpu_idle[1] = uptime_idle;
+
+	total = led->cpu.cpu_total[1] - led->cpu.cpu_total[0];
+	idle = led->cpu.cpu_idle[1] - led->cpu.cpu_idle[0];
+	if (idle > total) // kernel 2.6 workaround
+		idle = total;
+	/* CPU usage between 0 and 100 */
+	if (led->cpu.cpu_total[0] && total)
+		led->cpu.cpu_usage = ((total - idle)*100) / total;
+	if (led->cpu.cpu_usage < 0)
+		led->cpu.cpu_usage = 0;
+	else if (led->cpu.cpu_usage > 100)
+		led->cpu.cpu_usage = 100;
+
+	return 1;
+}
+
+/* records that line <line> of /proc/interrupts for IRQ <irq> matches pattern
+ * <pat>. Returns 0 if the memory is missing.
+ */
+static int irq_line_add(int line, unsigned int irq, int pat)
+{
+	struct irq_line *lines;
+
+	lines = realloc(irq_lines, (nb_irq_lines + 1) * sizeof(*lines));
+	if (!lines)
+		return 0;
+	irq_lines = lines;
+	lines[nb_irq_lines].line = line;
+	lines[nb_irq_lines].irq = irq;
+	lines[nb_irq_lines].pat = pat;
+	nb_irq_lines++;
+	return 1;
+}
+
+/* parsing context of /proc/interrupts */
+struct irq_ctx {
+	int line;     /* number of the current line */
+	int next;     /* next entry of irq_lines[] to be met */
+	int changed;  /* the file does not match irq_lines[], or memory is missing */
+};
+
+/* parses one line of /proc/interrupts. The interrupts of all CPUs are added to
+ * the count of each pattern of irq_pats[] matching one of the device names.
+ * The first pass records the matching lines into irq_lines[], then the next
+ * passes only parse these ones. A recorded line which does not carry the same
+ * IRQ number anymore reports a change and stops the read.
+ */
+static int parse_interrupts_line(char *ptr, void *ctx)
+{
+	struct irq_ctx *ictx = ctx;
+	char *words[IRQ_MAXWORDS];
+	unsigned int count, irq;
+	int line, nbw, pat, w;
+
+	line = ictx->line++;
+	if (irq_nblines &&
+	    (ictx->next >= nb_irq_lines || irq_lines[ictx->next].line != line))
+		return 0;
+
+	/* format :
+	 * [ 0-9]*:    count   pic   [hwirq-type]   device[, device]
+	 */
+
+	while (isblank(*ptr))
+		ptr++;
+	if (!isdigit(*ptr))
+		goto changed;
+	irq = strtoul(ptr, &ptr, 10);
+	if (*ptr != ':' || (irq_nblines && irq != irq_lines[ictx->next].irq))
+		goto changed;
+
+	/* skip the colon and the spaces */
+	while (isspace(*++ptr));
+
+	/* read counter(s).
+	 * Note: we may have several columns with digits on SMP systems. */
+	count = 0;
+	while (isdigit(*ptr)) {
+		int cpucount = 0;
+
+		do {
+			cpucount = cpucount*10 + *ptr - '0';
+		} while (isdigit(*++ptr));
+
+		if (!*ptr)
+			return 0;
+
+		count += cpucount;
+		/* skip the spaces */
+		while (isblank(*++ptr));
+		if (!*ptr)
+			return 0;
+	}
+
+	if (irq_nblines) {
+		/* add the count to the patterns known to match this line */
+		while (ictx->next < nb_irq_lines && irq_lines[ictx->next].line == line)
+			irq_pats[irq_lines[ictx->next++].pat].count += count;
+		return 0;
+	}
+
+	/* skip the PIC name */
+	while (*ptr && !isspace(*++ptr));
+
+	/* split the next words, which end with the device(s) name */
+	nbw = 0;
+	while (nbw < IRQ_MAXWORDS) {
+		while (isblank(*ptr) || *ptr == ',')
+			ptr++;
+		if (!*ptr)
+			break;
+		words[nbw++] = ptr;
+		while (*ptr && !isblank(*ptr) && *ptr != ',')
+			ptr++;
+		if (*ptr)
+			*(ptr++) = 0;
+	}
+
+	for (pat = 0; pat < nb_irq_pats; pat++) {
+		for (w = 0; w < nbw; w++)
+			if (fnmatch(irq_pats[pat].pattern, words[w], 0) == 0)
+				break;
+		if (w == nbw)
+			continue;
+
+		/* got it ! */
+		irq_pats[pat].count += count;
+		if (!irq_line_add(line, irq, pat))
+			ictx->changed = 1;
+	}
+	return 0;
+
+ changed:
+	if (!irq_nblines)
+		return 0;
+	ictx->changed = 1;
+	return 1;
+}
+
+/* reads the 10 seconds average of the "some" line of the pressure file of
+ * resource <res> unless it was already read during this period. Returns 0 on
+ * error.
+ */
+static int read_pressure(int res)
+{
+	char *ptr;
+
+#ifdef SIMUL
+	/* set by the script */
+	return 1;
+#endif
+	if (!src_stale(&src_pressure[res]))
+		return 1;
+
+	/* format :
+	 * some avg10=1.23 avg60=0.45 avg300=0.10 total=123456
+	 * full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+	 */
+	if (readfile(&pf_pressure[res], trash, trash_size) <= 0)
+		return 0;
+	ptr = strstr(trash, "avg10=");
+	if (!ptr)
+		return 0;
+	psi_avg10[res] = strtoul(ptr + 6, &ptr, 10) * 100;
+	if (*ptr == '.')
+		psi_avg10[res] += strtoul(ptr + 1, NULL, 10);
+	src_read(&src_pressure[res]);
+	return 1;
+}
+
+/* reads the 1 minute load average and the number of runnable tasks from
+ * /proc/loadavg unless it was already read during this period. Returns 0 on
+ * error.
+ */
+static int read_loadavg()
+{
+	char buffer[64];
+	char *ptr;
+	int ret, field;
+
+	if (!src_stale(&src_loadavg))
+		return 1;
+
+	/* format, well within a single read :
+	 * load1 load5 load15 runnable/total last_pid
+	 */
+	ret = pf_pread(&pf_loadavg, buffer, sizeof(buffer) - 1, 0);
+	if (ret <= 0)
+		return 0;
+	buffer[ret] = 0;
+
+	loadavg1 = strtoul(buffer, &ptr, 10) * 100;
+	if (*ptr == '.')
+		loadavg1 += strtoul(ptr + 1, &ptr, 10);
+
+	/* skip load5 and load15 */
+	for (field = 0; field < 2; field++) {
+		while (isspace(*ptr))
+			ptr++;
+		while (*ptr && !isspace(*ptr))
+			ptr++;
+	}
+	loadavg_run = strtoul(ptr, NULL, 10);
+	src_read(&src_loadavg);
+	return 1;
+}
+
+/* reads the number of conntrack entries and their limit, which may be changed
+ * at run time, unless they were already read during this period. Each one
+ * costs a single pread(). Returns 0 on error, eg: if conntrack is not loaded.
+ */
+static int read_conntrack()
+{
+	char buffer[12];
+	int ret;
+
+#ifdef SIMUL
+	/* set by the script */
+	return 1;
+#endif
+	if (!src_stale(&src_conntrack))
+		return 1;
+
+	ret = pf_pread(&pf_ct_count, buffer, sizeof(buffer) - 1, 0);
+	if (ret <= 0)
+		return 0;
+	buffer[ret] = 0;
+	ct_count = strtoul(buffer, NULL, 10);
+
+	ret = pf_pread(&pf_ct_max, buffer, sizeof(buffer) - 1, 0);
+	if (ret <= 0)
+		return 0;
+	buffer[ret] = 0;
+	ct_max = strtoul(buffer, NULL, 10);
+	src_read(&src_conntrack);
+	return 1;
+}
+
+/* returns the number of online CPUs from their list (eg: "0-3,6"), or 1 if
+ * it cannot be read.
+ */
+static unsigned int count_online()
+{
+	unsigned int first, last, count = 0;
+	char *ptr = trash;
+
+	if (readfile(&pf_cpu_online, trash, trash_size) <= 0)
+		return 1;
+	close(pf_cpu_online.fd);
+	pf_cpu_online.fd = -1;
+
+	while (isdigit(*ptr)) {
+		first = last = strtoul(ptr, &ptr, 10);
+		if (*ptr == '-')
+			last = strtoul(ptr + 1, &ptr, 10);
+		count += last - first + 1;
+		if (*ptr != ',')
+			break;
+		ptr++;
+	}
+	return count ? count : 1;
+}
+
+/* adds temperature sensor file <name> to the led's sensors. Returns 0 if the
+ * memory is missing.
+ */
+static int thermal_add_file(struct led *led, char *name)
+{
+	struct pfile *therm;
+
+	therm = realloc(led->therm, (led->nbtherm + 1) * sizeof(*therm));
+	if (!therm)
+		return 0;
+	led->therm = therm;
+	memset(&therm[led->nbtherm], 0, sizeof(*therm));
+	therm[led->nbtherm].name = name;
+	therm[led->nbtherm].fd = -1;
+	led->nbtherm++;
+	return 1;
+}
+
+/* registers the temperature sensors designated by <sensor> for the led : the
+ * file itself if it starts with '/', otherwise the temp file of the thermal
+ * zones matching pattern <sensor>. The files are only opened on first read.
+ * Returns the number of sensors added.
+ */
+static int thermal_add(struct led *led, const char *sensor)
+{
+	const char *dirname = "/sys/class/thermal";
+	struct dirent *de;
+	char *name;
+	int nb = 0;
+	DIR *dir;
+
+	if (*sensor == '/')
+		return thermal_add_file(led, (char *)sensor);
+
+	dir = opendir(dirname);
+	if (!dir)
+		return 0;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.' || fnmatch(sensor, de->d_name, 0) != 0)
+			continue;
+
+		name = malloc(strlen(dirname) + strlen(de->d_name) + 7);
+		if (!name)
+			break;
+		strcpy(name, dirname);
+		strcat(name, "/");
+		strcat(name, de->d_name);
+		strcat(name, "/temp");
+		if (!thermal_add_file(led, name)) {
+			free(name);
+			break;
+		}
+		nb++;
+	}
+	closedir(dir);
+	return nb;
+}
+
+/* arms a PSI trigger on the led's resource, reporting when some tasks stall
+ * for more than the led's threshold in percent of a 1 second window. Returns
+ * the trigger fd to be polled for priority events, or <0 if not supported.
+ */
+static int psi_trigger(struct led *led)
+{
+	char cmd[32], buffer[12];
+	unsigned int stall;
+	int fd;
+
+	stall = led->threshold >= 100 ? 1000000 : led->threshold ? led->threshold * 10000 : 1;
+
+	fd = open(pf_pressure[led->psi_res].name, O_RDWR | O_NONBLOCK);
+	if (fd < 0)
+		return fd;
+
+	strcpy(cmd, "some ");
+	strcat(cmd, ultoa_r(stall, buffer, sizeof(buffer)));
+	strcat(cmd, " 1000000");
+	if (write(fd, cmd, strlen(cmd) + 1) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* reads /proc/interrupts into the counts of irq_pats[] unless it was already
+ * read during this period. The matching lines are looked up again if the file
+ * changed since they were recorded. Returns 0 on error.
+ */
+static int read_interrupts()
+{
+	struct irq_ctx ctx;
+	int pat;
+
+	if (!src_stale(&src_interrupts))
+		return 1;
+
+	while (1) {
+		if (!irq_nblines)
+			nb_irq_lines = 0;
+		memset(&ctx, 0, sizeof(ctx));
+		for (pat = 0; pat < nb_irq_pats; pat++)
+			irq_pats[pat].count = 0;
+		if (readlines(&pf_interrupts, parse_interrupts_line, &ctx) <= 0)
+			return 0;
+		if (!irq_nblines) {
+			/* the lines are only known if they could all be recorded */
+			if (!ctx.changed)
+				irq_nblines = ctx.line;
+			break;
+		}
+		if (!ctx.changed && ctx.line == irq_nblines)
+			break;
+		irq_nblines = 0;
+	}
+	src_read(&src_interrupts);
+	return 1;
+}
+
+/* returns the entry of irq_pats[] for device name pattern <pattern>, which is
+ * created if needed. Returns <0 if the memory is missing.
+ */
+static int irq_pat_get(const char *pattern)
+{
+	struct irq_pat *pats;
+	int pat;
+
+	for (pat = 0; pat < nb_irq_pats; pat++)
+		if (strcmp(irq_pats[pat].pattern, pattern) == 0)
+			return pat;
+
+	pats = realloc(irq_pats, (nb_irq_pats + 1) * sizeof(*pats));
+	if (!pats)
+		return -1;
+	irq_pats = pats;
+	pats[nb_irq_pats].pattern = pattern;
+	pats[nb_irq_pats].count = 0;
+
+	/* the matching lines must be looked up again before being used */
+	irq_nblines = 0;
+	src_interrupts.seq = 0;
+	return nb_irq_pats++;
+}
+
+/* adds the interrupts of the devices matching <pattern> to those counted by
+ * the led. Returns 0 if the memory is missing.
+ */
+static int irq_led_add(struct led *led, const char *pattern)
+{
+	int *irqs;
+
+	irqs = realloc(led->irqs, (led->nbirqs + 1) * sizeof(*irqs));
+	if (!irqs)
+		return 0;
+	led->irqs = irqs;
+	irqs[led->nbirqs] = irq_pat_get(pattern);
+	if (irqs[led->nbirqs] < 0)
+		return 0;
+	led->nbirqs++;
+	return 1;
+}
 
-		while (*line && !isspace(*line) && *line != ':')
-			line++;
+/* returns the interrupts of the led's devices at the last read */
+static unsigned int irq_total(const struct led *led)
+{
+	unsigned int total = 0;
+	int i;
+
+	for (i = 0; i < led->nbirqs; i++)
+		total += irq_pats[led->irqs[i]].count;
+	return total;
+}
+
+/* reads the stats of all block devices used by disk leds unless they were
+ * already read during this period.
+ */
+static void read_disks()
+{
+	struct disk_dev *dev;
+	char buf[256];
+	char *ptr;
+	int ret;
+
+	if (!src_stale(&src_disks))
+		return;
 
-		/* if line points to ':', we have a name before it */
-		if (*line != ':')
+	for (dev = disk_devs; dev < disk_devs + nb_disk_devs; dev++) {
+		/* format, with the needed fields well within a single read :
+		 * rd_ios rd_merges rd_sectors rd_ticks wr_ios wr_merges ...
+		 */
+		ret = pf_pread(&dev->pf, buf, sizeof(buf) - 1, 0);
+		if (ret <= 0)
 			continue;
-		*(line++) = 0;
+		buf[ret] = 0;
+
+		ptr = buf;
+		dev->ios = strtoul(ptr, &ptr, 10);
+		strtoul(ptr, &ptr, 10);
+		strtoul(ptr, &ptr, 10);
+		strtoul(ptr, &ptr, 10);
+		dev->ios += strtoul(ptr, &ptr, 10);
+	}
+	src_read(&src_disks);
+}
 
-		for (if_num = 0; if_num < nbifs; if_num++) {
-			if (strcmp(name, ifs[if_num].name) == 0) {
-				ifs[if_num].status = IF_CHECK_PRESENT;
-				break;
-			}
+/* returns the entry of disk_devs[] for stats file <name>, which is created
+ * if needed. Returns <0 if the memory is missing.
+ */
+static int disk_dev_get(const char *dirname, const char *devname)
+{
+	struct disk_dev *devs;
+	char *name;
+	int dev;
+
+	name = malloc(strlen(dirname) + strlen(devname) + 7);
+	if (!name)
+		return -1;
+	strcpy(name, dirname);
+	strcat(name, "/");
+	strcat(name, devname);
+	strcat(name, "/stat");
+
+	for (dev = 0; dev < nb_disk_devs; dev++) {
+		if (strcmp(disk_devs[dev].pf.name, name) == 0) {
+			free(name);
+			return dev;
 		}
 	}
 
-	/* update all interfaces status according to the declared checks */
-	for (if_num = 0; if_num < nbifs; if_num++) {
-		if (ifs[if_num].status & IF_CHECK_PRESENT) {
-			if (!(ifs[if_num].check & IF_CHECK_LOGICAL) ||
-			    if_up(net_sock, ifs[if_num].name))
-				ifs[if_num].status |= IF_CHECK_LOGICAL;
-	
-			if (!(ifs[if_num].check & IF_CHECK_PHYSICAL) ||
-			    (glink(net_sock, ifs[if_num].name) == 1))
-				ifs[if_num].status |= IF_CHECK_PHYSICAL;
-		}
+	devs = realloc(disk_devs, (nb_disk_devs + 1) * sizeof(*devs));
+	if (!devs) {
+		free(name);
+		return -1;
 	}
+	disk_devs = devs;
+	memset(&devs[nb_disk_devs], 0, sizeof(*devs));
+	devs[nb_disk_devs].pf.name = name;
+	devs[nb_disk_devs].pf.fd = -1;
+
+	/* the new device must be read before being used */
+	src_disks.seq = 0;
+	return nb_disk_devs++;
 }
 
-/* retrieve CPU usage from /proc/uptime, and update cpu_total[] and cpu_idle[].
- * Return 0 if any error, or 1 if values were updated.
+/* looks up the block devices matching the led's disk_name pattern, or all
+ * disks except loop and ram devices if no pattern is set, and registers
+ * their stats files. If none is found, interrupts will be counted instead.
  */
-int update_cpu(struct led *led)
+static void disk_init(struct led *led)
 {
-	char *ptr;
-	unsigned int total, idle;
+	const char *dirname = led->disk_name ? "/sys/class/block" : "/sys/block";
+	struct dirent *de;
+	int *devs;
+	int nb = 0;
+	DIR *dir;
+
+	led->ide.nbstats = -1;
+	dir = opendir(dirname);
+	if (!dir)
+		goto no_dev;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
 
-	if (readfile("/proc/uptime", trash, sizeof(trash)) <= 0)
-		return 0;
+		if (led->disk_name ?
+		    fnmatch(led->disk_name, de->d_name, 0) != 0 :
+		    (strncmp(de->d_name, "loop", 4) == 0 || strncmp(de->d_name, "ram", 3) == 0))
+			continue;
 
-	/* format : 
-	 * cpu_total_sec.centisec cpu_idle_sec.centisec
-	 */
+		devs = realloc(led->ide.devs, (nb + 1) * sizeof(*devs));
+		if (!devs)
+			break;
+		led->ide.devs = devs;
+		devs[nb] = disk_dev_get(dirname, de->d_name);
+		if (devs[nb] < 0)
+			break;
+		nb++;
+	}
+	closedir(dir);
 
-	total = 0;
-	ptr = trash;
-	while (*ptr && *ptr != ' ') {
-		if (isdigit(*ptr)) /* ignore dot */
-			total = total*10 + *ptr - '0';
-		ptr++;
+	if (nb) {
+		led->ide.nbstats = nb;
+		return;
 	}
+ no_dev:
+	/* count the interrupts of IDE controllers instead */
+	irq_led_add(led, "ide*");
+	irq_led_add(led, "pata*");
+}
 
-	while (isspace(*ptr))
-		ptr++;
+/* retrieve disk activity from block devices stats, or IDE interrupt counts
+ * from /proc/interrupts if no device was found, and update ide_count[]. The
+ * number of reads and writes completed on the led's devices are cumulated.
+ * For interrupts, lines with device names beginning with 'ide' and 'pata' are
+ * cumulated. Return 0 if any error, or 1 if values were updated.
+ */
+int update_disk(struct led *led)
+{
+	unsigned int total = 0;
+	int dev;
 
-	idle = 0;
-	while (*ptr && *ptr != '\n') {
-		if (isdigit(*ptr)) /* ignore dot */
-			idle = idle*10 + *ptr - '0';
-		ptr++;
+	if (!led->ide.nbstats)
+		disk_init(led);
+
+	if (led->ide.nbstats < 0) {
+		if (!read_interrupts())
+			return 0;
+		total = irq_total(led);
 	}
+	else
+		read_disks();
 
-	led->cpu.cpu_total[0] = led->cpu.cpu_total[1];
-	led->cpu.cpu_total[1] = total;
-	led->cpu.cpu_idle[0] = led->cpu.cpu_idle[1];
-	led->cpu.cpu_idle[1] = idle;
+	for (dev = 0; dev < led->ide.nbstats; dev++)
+		total += disk_devs[led->ide.devs[dev]].ios;
 
-	total = led->cpu.cpu_total[1] - led->cpu.cpu_total[0];
-	idle = led->cpu.cpu_idle[1] - led->cpu.cpu_idle[0];
-	if (idle > total) // kernel 2.6 workaround
-		idle = total;
-	/* CPU usage between 0 and 100 */
-	if (led->cpu.cpu_total[0] && total)
-		led->cpu.cpu_usage = ((total - idle)*100) / total;
-	if (led->cpu.cpu_usage < 0)
-		led->cpu.cpu_usage = 0;
-	else if (led->cpu.cpu_usage > 100)
-		led->cpu.cpu_usage = 100;
+	led->ide.count[0] = led->ide.count[1];
+	led->ide.count[1] = total;
+	led->ide.disk_usage = led->ide.count[1] - led->ide.count[0];
 
 	return 1;
 }
 
-/* retrieve IDE interrupt counts from /proc/interrupts, and update ide_count[].
- * Lines with device names beginning with 'ide' and 'pata' are cumulated.
- * Return 0 if any error, or 1 if values were updated.
+
+/* LED output backends. A backend drives the NBLEDS LEDs designated by their
+ * number starting at zero, and may report the switch state. <init> receives
+ * the backend-specific arguments and returns <0 if the backend cannot be
+ * used. <set> changes a LED's state and may defer the change until <flush>
+ * is called. <read> returns the initial LEDs state (bit N for LED N).
+ * <switch_events> returns an fd which becomes readable when the switch changes
+ * state, whose pending events are flushed by <switch_pressed>, or <0 if the
+ * switch must be polled. Only <init> and <set> are mandatory.
  */
-int update_disk(struct led *led)
+struct backend {
+	const char *name;
+	int  (*init)(char *args);
+	void (*set)(int num, int on);
+	void (*flush)();
+	int  (*read)();
+	int  (*switch_pressed)();
+	int  (*switch_events)();
+};
+
+/*** ALIX backend : LEDs and switch on CS5536 GPIO ports ***/
+
+static const struct {
+	unsigned short port;
+	unsigned int mask;
+} alix_leds[NBLEDS] = {
+	{ LED1_PORT, LED1_MASK },
+	{ LED2_PORT, LED2_MASK },
+	{ LED3_PORT, LED3_MASK },
+};
+
+/* LED changes are not immediately written to the ports, they are collected
+ * here and written at once by alix_flush() so that LEDs sharing a port cost
+ * a single write. Each entry holds the set/clear bits to write to a port.
+ */
+static struct {
+	unsigned int port;
+	unsigned int value;
+} port_out[NBLEDS];
+static int nbports;
+
+static int alix_init(char *args)
 {
-	char *ptr;
-	unsigned int total, count;
+	return iopl(3);
+}
 
+static void alix_set(int num, int on)
+{
+	unsigned int port = alix_leds[num].port;
+	unsigned int mask = alix_leds[num].mask;
+	int i;
 
-	if (readfile("/proc/interrupts", trash, sizeof(trash)) <= 0)
-		return 0;
+	for (i = 0; i < nbports && port_out[i].port != port; i++);
+	if (i == nbports) {
+		port_out[i].port = port;
+		port_out[i].value = 0;
+		nbports++;
+	}
 
-	total = 0;
-	ptr = NULL;
-	while ((ptr = nextline(trash, ptr)) != NULL) {
-		/* format : 
-		 * [ 0-9]*:    count   pic   device[, device]
-		 */
+	/* the last change of a LED replaces the previous ones */
+	port_out[i].value = (port_out[i].value & ~mask) | (mask & (on ? LED_ON : ~LED_ON));
+}
 
-		while (*ptr != ':') {
-			if (!*ptr || *ptr == '\n' ||
-			    (*ptr != ' ' && !isdigit(*ptr)))
-				goto next_line;
-			ptr++;
+/* writes all pending LED changes, one outl() per port */
+static void alix_flush()
+{
+	int i;
+
+	for (i = 0; i < nbports; i++) {
+		if (!port_out[i].value)
+			continue;
+		outl(port_out[i].value, port_out[i].port);
+		STATS_INC(led_writes);
+		port_out[i].value = 0;
+	}
+}
+
+static int alix_read()
+{
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < NBLEDS; i++)
+		if (inl(alix_leds[i].port) & alix_leds[i].mask & LED_ON)
+			ret |= 1 << i;
+	return ret;
+}
+
+static int alix_switch_pressed()
+{
+	return !(inl(SWITCH_PORT) & SWITCH_MASK);
+}
+
+/*** sysfs backend : /sys/class/leds/<name>/brightness ***/
+
+static int sysfs_fd[NBLEDS];
+static char sysfs_max[NBLEDS][12]; /* max_brightness, written to light on */
+
+/* args: comma-separated list of LED names in /sys/class/leds. The brightness
+ * files are kept open. The LEDs' triggers are disabled.
+ */
+static int sysfs_init(char *args)
+{
+	struct pfile pf;
+	char path[256];
+	char *name;
+	int num, fd, len;
+
+	for (num = 0; num < NBLEDS; num++) {
+		sysfs_fd[num] = -1;
+		name = args;
+		if (!name || !*name)
+			continue;
+		args = strchr(args, ',');
+		if (args)
+			*args++ = 0;
+		if (strlen(name) > sizeof(path) - 32)
+			return -1;
+
+		strcpy(path, "/sys/class/leds/");
+		strcat(path, name);
+		len = strlen(path);
+
+		strcpy(path + len, "/trigger");
+		fd = open(path, O_WRONLY);
+		if (fd >= 0) {
+			write(fd, "none", 4);
+			close(fd);
+		}
+
+		strcpy(path + len, "/max_brightness");
+		pf.name = path;
+		pf.fd = -1;
+		if (readfile(&pf, sysfs_max[num], sizeof(sysfs_max[num])) <= 0)
+			strcpy(sysfs_max[num], "1");
+		sysfs_max[num][strcspn(sysfs_max[num], "\n")] = 0;
+		close(pf.fd);
+
+		strcpy(path + len, "/brightness");
+		sysfs_fd[num] = open(path, O_RDWR);
+		if (sysfs_fd[num] < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void sysfs_set(int num, int on)
+{
+	const char *val = on ? sysfs_max[num] : "0";
+
+	if (sysfs_fd[num] >= 0) {
+		pwrite(sysfs_fd[num], val, strlen(val), 0);
+		STATS_INC(led_writes);
+	}
+}
+
+static int sysfs_read()
+{
+	char buf[12];
+	int ret = 0;
+	int num;
+
+	for (num = 0; num < NBLEDS; num++) {
+		if (sysfs_fd[num] >= 0 && pread(sysfs_fd[num], buf, 1, 0) == 1 && buf[0] != '0')
+			ret |= 1 << num;
+	}
+	return ret;
+}
+
+/*** GPIO backend : lines of a /dev/gpiochipN character device ***/
+
+static int gpio_leds_fd, gpio_switch_fd;
+static int gpio_switch_edges; /* gpio_switch_fd reports edges */
+static int gpio_invert; /* bit N = LED N is active low, bit NBLEDS = switch */
+static int gpio_nbleds;
+static struct gpiohandle_data gpio_values;
+
+/* parses a comma-separated list of line offsets from <args> into <offsets>,
+ * at most <max>. A '!' before an offset indicates an active low line, and
+ * sets the corresponding bit in gpio_invert starting at bit <bit>. Returns
+ * the number of offsets.
+ */
+static int gpio_parse_lines(char *args, __u32 *offsets, int max, int bit)
+{
+	int nb;
+
+	for (nb = 0; nb < max && args && *args; nb++, bit++) {
+		if (*args == '!') {
+			gpio_invert |= 1 << bit;
+			args++;
+		}
+		offsets[nb] = strtoul(args, &args, 10);
+		if (*args == ',')
+			args++;
+	}
+	return nb;
+}
+
+/* args: <chip>:<led1>[,<led2>[,<led3>]][:<switch>] where <chip> is a device
+ * name or path, and the other ones are line offsets, optionally preceded by
+ * '!' for active low lines. The switch line reports its edges if supported.
+ */
+static int gpio_init(char *args)
+{
+	struct gpiohandle_request req;
+	struct gpioevent_request ereq;
+	char path[64];
+	char *lines, *sw;
+	int chip, num;
+
+	gpio_leds_fd = gpio_switch_fd = -1;
+	lines = strchr(args, ':');
+	if (!lines)
+		return -1;
+	*lines++ = 0;
+	sw = strchr(lines, ':');
+	if (sw)
+		*sw++ = 0;
+
+	if (*args != '/' && strlen(args) < sizeof(path) - 5) {
+		strcpy(path, "/dev/");
+		strcat(path, args);
+		args = path;
+	}
+
+	chip = open(args, O_RDONLY);
+	if (chip < 0)
+		return chip;
+
+	memset(&req, 0, sizeof(req));
+	strcpy(req.consumer_label, "alix-leds");
+	req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+	req.lines = gpio_nbleds = gpio_parse_lines(lines, req.lineoffsets, NBLEDS, 0);
+
+	/* the LEDs start off, which is the high level for active low lines */
+	for (num = 0; num < gpio_nbleds; num++)
+		req.default_values[num] = gpio_values.values[num] = (gpio_invert >> num) & 1;
+	if (req.lines && ioctl(chip, GPIO_GET_LINEHANDLE_IOCTL, &req) == 0)
+		gpio_leds_fd = req.fd;
+
+	if (sw) {
+		memset(&ereq, 0, sizeof(ereq));
+		strcpy(ereq.consumer_label, "alix-leds");
+		ereq.handleflags = GPIOHANDLE_REQUEST_INPUT;
+		ereq.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+		if (gpio_parse_lines(sw, &ereq.lineoffset, 1, NBLEDS) &&
+		    ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &ereq) == 0) {
+			gpio_switch_fd = ereq.fd;
+			gpio_switch_edges = 1;
+			fcntl(gpio_switch_fd, F_SETFL, O_NONBLOCK);
+		}
+		else {
+			/* the chip does not report edges, the line will be polled */
+			memset(&req, 0, sizeof(req));
+			strcpy(req.consumer_label, "alix-leds");
+			req.flags = GPIOHANDLE_REQUEST_INPUT;
+			req.lines = gpio_parse_lines(sw, req.lineoffsets, 1, NBLEDS);
+			if (req.lines && ioctl(chip, GPIO_GET_LINEHANDLE_IOCTL, &req) == 0)
+				gpio_switch_fd = req.fd;
 		}
+	}
+	close(chip);
+	return (gpio_leds_fd < 0) ? -1 : 0;
+}
+
+static void gpio_set(int num, int on)
+{
+	if (num < gpio_nbleds)
+		gpio_values.values[num] = !on ^ !((gpio_invert >> num) & 1);
+}
+
+/* all lines are written at once */
+static void gpio_flush()
+{
+	ioctl(gpio_leds_fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &gpio_values);
+	STATS_INC(led_writes);
+}
+
+static int gpio_switch_pressed()
+{
+	struct gpiohandle_data data;
+	struct gpioevent_data events[4];
+
+	if (gpio_switch_fd < 0)
+		return 0;
+
+	/* the pending edges are not needed, only the current value is */
+	if (gpio_switch_edges)
+		while (read(gpio_switch_fd, events, sizeof(events)) > 0);
+
+	if (ioctl(gpio_switch_fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0)
+		return 0;
+	return !data.values[0] ^ !((gpio_invert >> NBLEDS) & 1);
+}
+
+static int gpio_switch_events()
+{
+	return gpio_switch_edges ? gpio_switch_fd : -1;
+}
+
+/*** simulated backend : logs LED transitions to a file ***/
+
+static int sim_fd;
+static unsigned int sim_start;
+static int sim_state;
+static int sim_switch; /* switch state, only changed by simulation scripts */
+
+/* args: output file name, or standard output if empty. Each flush changing
+ * any LED produces a line with the date relative to the start in seconds and
+ * microseconds, and the state of all LEDs, eg: "12.345678 100".
+ */
+static int sim_init(char *args)
+{
+	sim_fd = *args ? open(args, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644) : 1;
+	sim_start = get_date();
+	return sim_fd;
+}
+
+static void sim_set(int num, int on)
+{
+	if (on)
+		sim_state |= 1 << num;
+	else
+		sim_state &= ~(1 << num);
+}
+
+static void sim_flush()
+{
+	char line[32], buffer[12];
+#ifdef SIMUL
+	unsigned long long date = sim_clock;
+#else
+	unsigned int date = get_date() - sim_start;
+#endif
+	const char *usec;
+	int num;
+
+	strcpy(line, ultoa_r(date / 1000000, buffer, sizeof(buffer)));
+	strcat(line, ".");
+	usec = ultoa_r(date % 1000000 + 1000000, buffer, sizeof(buffer));
+	strcat(line, usec + 1);
+	strcat(line, " ");
+	for (num = 0; num < NBLEDS; num++)
+		strcat(line, (sim_state >> num) & 1 ? "1" : "0");
+	fdputs(sim_fd, line);
+	STATS_INC(led_writes);
+}
+
+static int sim_switch_pressed()
+{
+	return sim_switch;
+}
+
+static const struct backend backends[] = {
+	{
+		.name = "alix", .init = alix_init, .set = alix_set, .flush = alix_flush,
+		.read = alix_read, .switch_pressed = alix_switch_pressed,
+	},
+	{
+		.name = "sysfs", .init = sysfs_init, .set = sysfs_set, .read = sysfs_read,
+	},
+	{
+		.name = "gpio", .init = gpio_init, .set = gpio_set, .flush = gpio_flush,
+		.switch_pressed = gpio_switch_pressed, .switch_events = gpio_switch_events,
+	},
+	{
+		.name = "sim", .init = sim_init, .set = sim_set, .flush = sim_flush,
+		.switch_pressed = sim_switch_pressed,
+	},
+};
+
+/* the backend in use, and its arguments */
+#ifdef SIMUL
+static const struct backend *backend = &backends[3];
+#else
+static const struct backend *backend = &backends[0];
+#endif
+static char *backend_args = "";
+
+/* Software copy of the LEDs state, bit N set means that LED N+1 is on. The
+ * daemon being the only one to drive the LEDs, it always knows their state
+ * and never has to read it back from the hardware. <led_flushed> is the state
+ * last sent to the backend.
+ */
+static unsigned int led_shadow, led_flushed;
+
+/* turns LED <led> on if <on> is non-zero, otherwise off. The change is only
+ * applied by flush_leds().
+ */
+static inline void setled(struct led *led, int on)
+{
+	unsigned int bit = 1 << (led - leds);
+
+	if (on)
+		led_shadow |= bit;
+	else
+		led_shadow &= ~bit;
+}
+
+/* sends the LEDs which changed since last call to the backend and applies
+ * the changes.
+ */
+static void flush_leds()
+{
+	unsigned int changed = led_shadow ^ led_flushed;
+	int num;
+
+	if (!changed)
+		return;
+
+	for (num = 0; num < NBLEDS; num++)
+		if ((changed >> num) & 1)
+			backend->set(num, (led_shadow >> num) & 1);
+	led_flushed = led_shadow;
+	if (backend->flush)
+		backend->flush();
+}
+
+static inline int switch_pressed()
+{
+	return backend->switch_pressed ? backend->switch_pressed() : 0;
+}
+
+/* waits for up to <delay> microseconds, or until the switch settles after an
+ * edge if the backend reports them. A negative <delay> waits for an edge, or
+ * for the poll period without edges. This is used by the switch check mode
+ * which does not run the event loop.
+ */
+static void switch_wait(int delay)
+{
+	struct pollfd pfd;
+
+	pfd.fd = backend->switch_events ? backend->switch_events() : -1;
+	if (pfd.fd < 0) {
+		usleep(delay < 0 ? SWITCH_POLL : delay);
+		return;
+	}
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, delay < 0 ? -1 : delay / 1000) > 0)
+		usleep(SWITCH_DEBOUNCE);
+}
 
-		/* skip the colon and the spaces */
-		while (isspace(*++ptr));
+/* learns the state of the LEDs from the backend, if possible. This is only
+ * needed once at startup to know the state left by a previous run.
+ */
+static void init_shadow()
+{
+	led_shadow = led_flushed = backend->read ? backend->read() : 0;
+}
+
+/* returns the leds status in bit 0=led1, 1=led2, 2=led3 */
+static inline int get_all_leds()
+{
+	return led_shadow;
+}
+
+/* sets the leds status at once with bit 0=led1, 1=led2, 2=led3 */
+static void set_all_leds(int state)
+{
+	int i;
+
+	for (i = 0; i < NBLEDS; i++)
+		setled(&leds[i], state & (1 << i));
+}
+
+#ifdef SIMUL
+/* scripted CPU usage, ramping from <sim_cpu_from> to <sim_cpu_to> between
+ * <sim_ramp_start> and <sim_ramp_end>, and scripted disk activity in I/Os per
+ * second, accumulated per LED in millionths of I/Os since the last sample.
+ */
+static int sim_cpu_from, sim_cpu_to;
+static unsigned long long sim_ramp_start, sim_ramp_end;
+static unsigned int sim_disk_rate;
+static unsigned long long sim_disk_acc[NBLEDS], sim_disk_last[NBLEDS];
+static int sim_temp; /* scripted temperature in millidegrees */
+static unsigned int sim_irq_rate; /* scripted interrupts per second */
+static unsigned long long sim_irq_acc, sim_irq_last;
+
+/* returns the scripted CPU usage at the current virtual date */
+static unsigned int sim_cpu_usage()
+{
+	if (sim_clock >= sim_ramp_end)
+		return sim_cpu_to;
+	return sim_cpu_from + (long long)(sim_cpu_to - sim_cpu_from) *
+		(long long)(sim_clock - sim_ramp_start) / (long long)(sim_ramp_end - sim_ramp_start);
+}
 
-		/* read counter(s).
-		 * Note: we may have several columns with digits on SMP systems. */
-		count = 0;
-		while (isdigit(*ptr)) {
-			int cpucount = 0;
+/* accumulates the I/Os done at the current rate since the last call */
+static void sim_disk_accrue()
+{
+	int i;
+
+	for (i = 0; i < NBLEDS; i++) {
+		sim_disk_acc[i] += sim_disk_rate * (sim_clock - sim_disk_last[i]);
+		sim_disk_last[i] = sim_clock;
+	}
+}
+
+/* accumulates the scripted interrupts since the last call, in millionths */
+static void sim_irq_accrue()
+{
+	sim_irq_acc += sim_irq_rate * (sim_clock - sim_irq_last);
+	sim_irq_last = sim_clock;
+}
+#endif
+
+/* updates the led's CPU usage, from /proc/stat or /proc/uptime if not
+ * available. Return 0 if any error, or 1 if values were updated.
+ */
+static int sample_cpu(struct led *led)
+{
+	unsigned int start = STATS_DATE();
+	int ret;
 
-			do {
-				cpucount = cpucount*10 + *ptr - '0';
-			} while (isdigit(*++ptr));
+#ifdef SIMUL
+	led->cpu.cpu_usage = sim_cpu_usage();
+	ret = 1;
+#else
+	ret = update_cpu_stat(led) || update_cpu(led);
+#endif
+	led->level = led->cpu.cpu_usage;
+	STATS_ADD(cpu_time, STATS_DATE() - start);
+	STATS_INC(cpu_calls);
+	return ret;
+}
 
-			if (!*ptr || *ptr == '\n')
-				goto next_line;
+/* sets the level of an error or interrupt led from the rate at which <count>
+ * increased since the previous sample, in events per second. The level is
+ * zero below the led's threshold, and 100 from 10 times the threshold.
+ */
+static void rate_level(struct led *led, unsigned int count, unsigned int date)
+{
+	unsigned long long rate;
 
-			count += cpucount;
-			/* skip the spaces */
-			while (isblank(*++ptr));
-			if (!*ptr || *ptr == '\n')
-				goto next_line;
-		}
+	rate = (count - led->prev_count) * 1000000ULL / (date - led->prev_date);
+	if (count == led->prev_count || rate < led->threshold)
+		led->level = 0;
+	else {
+		rate = led->threshold ? rate * 10 / led->threshold : rate;
+		led->level = rate > 100 ? 100 : rate ? rate : 1;
+	}
+}
 
-		/* skip the PIT names */
-		while (*ptr && !isspace(*++ptr));
+/* updates the led's level from the counters collected by the last read of
+ * /proc/net/dev. For traffic leds, it's the throughput in percent of the sum
+ * of the links speeds, which are only queried when the interfaces status
+ * changes. For error leds, it's zero below the threshold of errors per second
+ * and reaches 100 at 10 times the threshold. Returns 0 if no new counters
+ * were collected since the previous call.
+ */
+static int sample_netdev(struct led *led)
+{
+	unsigned int count = 0, speed = 0;
+	unsigned long long bits;
+	struct if_list *l;
+	int moved = 0;
 
-		/* skip the spaces again */
-		while (isblank(*++ptr));
-		if (!*ptr || *ptr == '\n')
-			goto next_line;
-
-		/* OK, we have the device(s) name here. Iterate over all names */
-		while (1) {
-			const char *dev;
-
-			dev = ptr;
-			while (*ptr && *ptr != '\n' && *ptr != ',')
-				ptr++;
-
-			/* note: we don't overwrite the final LF, because it
-			 * will either not match or be ignored.
-			 */
-			if (*ptr && *ptr != '\n')
-				*(ptr++) = 0;
-			if (strncmp(dev, "ide", 3) == 0 || strncmp(dev, "pata", 4) == 0)
-				/* got it ! */
-				break;
+	if (src_netdev.seq == led->prev_seq)
+		return 0;
 
-			if (!*ptr || *ptr == '\n')
-				goto next_line;
+	for (l = led->intf; l; l = l->next) {
+		count += led->type == LED_ERRORS ? l->ifs->errors : l->ifs->bytes;
 
-			/* skip the comma and spaces again */
-			while (isblank(*++ptr));
-			if (!*ptr || *ptr == '\n')
-				goto next_line;
+		/* the sum jumps when an interface appears or leaves the list */
+		if (l->prev_status != l->ifs->status) {
+			l->prev_status = l->ifs->status;
+			moved = 1;
+			if (led->type != LED_ERRORS && (l->ifs->status & IF_CHECK_PRESENT))
+				l->ifs->speed = net_sock >= 0 ? gspeed(net_sock, l->ifs->name) : 0;
 		}
 
-		/* if we get here, we found the right line */
-		total += count;
-	next_line:
-		;
+		/* absent interfaces and pattern elements add no speed */
+		if (led->type != LED_ERRORS && (l->ifs->status & IF_CHECK_PRESENT))
+			speed += l->ifs->speed ? l->ifs->speed : TRAFFIC_SPEED;
 	}
+	if (!speed)
+		speed = TRAFFIC_SPEED;
 
-	led->ide.count[0] = led->ide.count[1];
-	led->ide.count[1] = total;
-	led->ide.disk_usage = led->ide.count[1] - led->ide.count[0];
+	if (!led->prev_seq || moved || src_netdev.date == led->prev_date)
+		;
+	else if (led->type == LED_ERRORS)
+		rate_level(led, count, src_netdev.date);
+	else {
+		/* bits per microsecond are Mb/s */
+		bits = (count - led->prev_count) * 8ULL * 100;
+		bits /= (unsigned long long)(src_netdev.date - led->prev_date) * speed;
+		led->level = bits > 100 ? 100 : bits ? bits : count != led->prev_count;
+	}
+	led->prev_count = count;
+	led->prev_seq = src_netdev.seq;
+	led->prev_date = src_netdev.date;
+	return 1;
+}
 
+/* updates the level of a pressure led from the 10 seconds average of its
+ * resource's stall time, in percent. Without trigger, the level is zero below
+ * the threshold. With a trigger, the kernel already reported that it was
+ * exceeded, and the led remains active until the average drops below 1%.
+ * Returns 0 if not updated.
+ */
+static int sample_psi(struct led *led)
+{
+	if (!read_pressure(led->psi_res))
+		return 0;
+	led->level = psi_avg10[led->psi_res] / 100;
+	if (led->level > 100)
+		led->level = 100;
+	if (led->psi_evh.fd < 0 && led->level < led->threshold)
+		led->level = 0;
 	return 1;
 }
 
+/* updates the level of a load led from the 1 minute load average or the
+ * number of runnable tasks other than us, whichever is higher, in percent of
+ * the number of online CPUs which is only counted once. Returns 0 if not
+ * updated.
+ */
+static int sample_load(struct led *led)
+{
+	unsigned int load, run;
 
-static inline int switch_pressed()
+	if (!read_loadavg())
+		return 0;
+	if (!nb_online)
+		nb_online = count_online();
+
+	load = loadavg1 / nb_online;
+	run = (loadavg_run > 1 ? loadavg_run - 1 : 0) * 100 / nb_online;
+	if (run > load)
+		load = run;
+	led->level = load > 100 ? 100 : load;
+	return 1;
+}
+
+/* updates the level of a thermal led from the hottest of its sensors, 0 when
+ * it is more than THERMAL_RANGE degrees below the trip point, and 100 once the
+ * trip point is reached. Each sensor costs a single pread(). Returns 0 if none
+ * could be read.
+ */
+static int sample_thermal(struct led *led)
 {
-	return !(inl(SWITCH_PORT) & SWITCH_MASK);
+	int i, ret, temp, hottest = 0, found = 0;
+	char buffer[16];
+
+	for (i = 0; i < led->nbtherm; i++) {
+#ifdef SIMUL
+		ret = 0;
+		temp = sim_temp;
+		found = 1;
+#else
+		/* format : temperature in millidegrees Celsius */
+		ret = pf_pread(&led->therm[i], buffer, sizeof(buffer) - 1, 0);
+		if (ret <= 0)
+			continue;
+		buffer[ret] = 0;
+		temp = atoi(buffer);
+#endif
+		if (!found++ || temp > hottest)
+			hottest = temp;
+	}
+	if (!found)
+		return 0;
+
+	temp = led->trip - hottest;
+	if (temp <= 0)
+		led->level = 100;
+	else if (temp >= THERMAL_RANGE * 1000)
+		led->level = 0;
+	else
+		led->level = 100 - temp / (THERMAL_RANGE * 10);
+	return 1;
 }
 
-static inline void setled(unsigned leds, unsigned mask, unsigned port)
+/* updates the level of a conntrack led from the occupancy of the conntrack
+ * table in percent. Returns 0 if not updated.
+ */
+static int sample_conntrack(struct led *led)
 {
-	//#ifndef DEBUG
-	outl(leds & mask, port);
-	//#endif
+	if (!read_conntrack() || !ct_max)
+		return 0;
+	led->level = ct_count >= ct_max ? 100 : (unsigned long long)ct_count * 100 / ct_max;
+	return 1;
 }
 
-/* returns the 3 leds status in [0]=led1, [1]=led2, [2]=led3 */
-static int get_all_leds()
+/* updates the level of an interrupt led from the rate of interrupts of its
+ * devices, the same way as for error leds. Returns 0 if not updated.
+ */
+static int sample_irqs(struct led *led)
 {
-	int ret = 0;
+	unsigned int count;
 
-	if (inl(LED1_PORT) & LED1_MASK & LED_ON)
-		ret |= 1;
-	if (inl(LED2_PORT) & LED2_MASK & LED_ON)
-		ret |= 2;
-	if (inl(LED3_PORT) & LED3_MASK & LED_ON)
-		ret |= 4;
-	return ret;
+#ifdef SIMUL
+	sim_irq_accrue();
+	if (src_stale(&src_interrupts))
+		src_read(&src_interrupts);
+	count = sim_irq_acc / SLEEP_1SEC;
+#else
+	if (!read_interrupts())
+		return 0;
+	count = irq_total(led);
+#endif
+	if (src_interrupts.seq == led->prev_seq)
+		return 0;
+
+	if (led->prev_seq && src_interrupts.date != led->prev_date)
+		rate_level(led, count, src_interrupts.date);
+	led->prev_count = count;
+	led->prev_seq = src_interrupts.seq;
+	led->prev_date = src_interrupts.date;
+	return 1;
 }
 
-/* sets the 3 leds status at once with [0]=led1, [1]=led2, [2]=led3 */
-static void set_all_leds(int state)
+/* updates the level of a cpu, traffic, error, pressure, load, thermal,
+ * conntrack or interrupt led. Returns 0 if not updated.
+ */
+static int sample_level(struct led *led)
+{
+	if (led->type == LED_IRQ)
+		return sample_irqs(led);
+	if (led->type == LED_CONNTRACK)
+		return sample_conntrack(led);
+	if (led->type == LED_THERMAL)
+		return sample_thermal(led);
+	if (led->type == LED_LOAD)
+		return sample_load(led);
+	if (led->type == LED_TRAFFIC || led->type == LED_ERRORS)
+		return sample_netdev(led);
+	if (led->type == LED_PSI)
+		return sample_psi(led);
+	return sample_cpu(led);
+}
+
+/* updates the led's disk activity. Return 0 if any error, or 1 if values
+ * were updated.
+ */
+static int sample_disk(struct led *led)
 {
-	setled(LED1_MASK, state & 1 ? LED_ON : ~LED_ON, LED1_PORT);
-	setled(LED2_MASK, state & 2 ? LED_ON : ~LED_ON, LED2_PORT);
-	setled(LED3_MASK, state & 4 ? LED_ON : ~LED_ON, LED3_PORT);
+	unsigned int start = STATS_DATE();
+	int ret;
+
+#ifdef SIMUL
+	sim_disk_accrue();
+	led->ide.disk_usage = sim_disk_acc[led - leds] / SLEEP_1SEC;
+	sim_disk_acc[led - leds] %= SLEEP_1SEC;
+	ret = 1;
+#else
+	ret = update_disk(led);
+#endif
+	STATS_ADD(disk_time, STATS_DATE() - start);
+	STATS_INC(disk_calls);
+	return ret;
 }
 
 void manage_disk(struct led *led)
 {
 	if (led->state == 0) {
-		setled(led->mask, ~LED_ON, led->port);
-		if (update_disk(led))
+		setled(led, 0);
+		if (sample_disk(led))
 			led->state = 1;
 		led->sleep = SLEEP_1SEC * 250/1000;
 		/* we need two measures */
@@ -725,7 +3223,7 @@ void manage_disk(struct led *led)
 
 	/* just check stats at the beginning of a period */
 	if (led->state <= 2)
-		update_disk(led);
+		sample_disk(led);
 
 	/* do not switch led status during intermediate states */
 	if (led->state == 1 || led->state == 3)
@@ -736,24 +3234,29 @@ void manage_disk(struct led *led)
 	/* We want 100ms ON/25ms OFF every time we see disk activity */
 	switch (led->state) {
 	case 1: /* led is off for at least 250 ms */
-		setled(led->mask, ~LED_ON, led->port);
+		setled(led, 0);
 		led->sleep = (SLEEP_1SEC * 250/1000);
 		break;
 	case 2: /* led is ON */
-		setled(led->mask, LED_ON, led->port);
+		setled(led, 1);
 		led->sleep = (SLEEP_1SEC * 100/1000);
 		break;
 	case 3: /* led flashes OFF */
-		setled(led->mask, ~LED_ON, led->port);
+		setled(led, 0);
 		led->sleep = (SLEEP_1SEC * 25/1000);
 		break;
 	}
 }
 
-void manage_cpu(struct led *led)
+/* blinks the led faster as its level increases. Error, pressure, thermal and
+ * interrupt leds remain off at level zero, and pressure leds with a trigger
+ * then wait for the kernel to report a pressure (sleep <0). Conntrack leds
+ * remain lit once the table is full.
+ */
+void manage_level(struct led *led)
 {
 	if (led->state == 0) {
-		if (update_cpu(led))
+		if (sample_level(led))
 			led->state = 1;
 		led->count = 0;
 		led->limit = 1;
@@ -764,35 +3267,49 @@ void manage_cpu(struct led *led)
 
 	led->count++;
 	if (led->count >= led->limit) {
-		int last_usage = led->cpu.cpu_usage;
+		int last_usage = led->level;
 		int diff;
 
-		update_cpu(led);
+		sample_level(led);
 		/* We want 500ms ON/500ms OFF at 0% CPU, and 40ms ON/60 ms OFF at 100%,
 		 * which means that we come here 10 times faster at 100%. If we detect
 		 * a fast variation, we will plan to quickly recheck.
 		 */
 
-		diff = (led->cpu.cpu_usage - last_usage);
+		diff = (led->level - last_usage);
 		if (diff < 0)
 			diff = -diff;
 
 		if (diff < 10)
-			led->limit = led->cpu.cpu_usage / 10;
+			led->limit = led->level / 10;
 		else
-			led->limit = led->cpu.cpu_usage / 50;
+			led->limit = led->level / 50;
 		led->count = 0;
 	}
 
 	switch (led->state) {
 	case 1:
-		led->sleep = (SLEEP_1SEC * 40/1000) + (SLEEP_1SEC * 46/10000) * (100 - led->cpu.cpu_usage);
-		setled(led->mask, LED_ON, led->port);
+		if (!led->level && led->psi_evh.fd >= 0) {
+			setled(led, 0);
+			led->sleep = -1;
+			led->state = 0;
+			break;
+		}
+		if (led->level >= 100 && led->type == LED_CONNTRACK) {
+			/* saturated, check again in half a second */
+			setled(led, 1);
+			led->sleep = SLEEP_1SEC / 2;
+			led->count = led->limit;
+			break;
+		}
+		led->sleep = (SLEEP_1SEC * 40/1000) + (SLEEP_1SEC * 46/10000) * (100 - led->level);
+		setled(led, led->level || (led->type != LED_ERRORS && led->type != LED_PSI &&
+		                           led->type != LED_THERMAL && led->type != LED_IRQ));
 		led->state = 2;
 		break;
 	case 2:
-		led->sleep = (SLEEP_1SEC * 60/1000) + (SLEEP_1SEC * 44/10000) * (100 - led->cpu.cpu_usage);
-		setled(led->mask, ~LED_ON, led->port);
+		led->sleep = (SLEEP_1SEC * 60/1000) + (SLEEP_1SEC * 44/10000) * (100 - led->level);
+		setled(led, 0);
 		led->state = 1;
 		break;
 	}
@@ -804,12 +3321,12 @@ void manage_running(struct led *led)
 	case 0: led->state = 1;
 		/* fall through */
 	case 1:
-		setled(led->mask, LED_ON, led->port);
+		setled(led, 1);
 		led->sleep = fast_mode ? SLEEP_1SEC * 5 / 100 : SLEEP_1SEC * 40/100;
 		led->state = 2;
 		break;
 	case 2:
-		setled(led->mask, ~LED_ON, led->port);
+		setled(led, 0);
 		led->sleep = fast_mode ? SLEEP_1SEC * 5 / 100 : SLEEP_1SEC * 60/100;
 		led->state = 1;
 		break;
@@ -856,7 +3373,7 @@ void manage_net(struct led *led)
 		}
 
 		if (led->count == 0 && led->flash) {
-			setled(led->mask, LED_ON, led->port);
+			setled(led, 1);
 			if (led->flash == 2) {
 				/* two flashes */
 				led->sleep = SLEEP_500M * 45/100;
@@ -868,113 +3385,763 @@ void manage_net(struct led *led)
 			}
 		}
 		else if (led->count < led->limit) {
-			setled(led->mask, LED_ON, led->port);
+			setled(led, 1);
 			led->sleep = SLEEP_500M;
 		}
 		else {
-			setled(led->mask, ~LED_ON, led->port);
+			setled(led, 0);
 			led->sleep = SLEEP_500M;
 		}
 		break;
 	case 2:
-		setled(led->mask, ~LED_ON, led->port);
+		setled(led, 0);
 		led->sleep = SLEEP_500M * 15/100;
 		led->state = 3;
 		break;
 	case 3:
-		setled(led->mask, LED_ON, led->port);
+		setled(led, 1);
 		led->sleep = SLEEP_500M * 25/100;
 		led->state = 4;
 		break;
 	case 4:
-		setled(led->mask, ~LED_ON, led->port);
+		setled(led, 0);
 		led->sleep = SLEEP_500M * 15/100;
 		led->state = 1;
 		break;
 	}
 
-	if (led->state == 1) {
-		led->count++;
-		if (led->count >= MAXSTEPS)
-			led->count = 0;
+	if (led->state == 1) {
+		led->count++;
+		if (led->count >= MAXSTEPS)
+			led->count = 0;
+	}
+}
+
+/* returns 0 if it needs to stop */
+int handle_special_blink()
+{
+	static int cycle;
+	int i;
+	int finished = 1;
+	unsigned char pattern;
+
+	if (date_before(now, blinker_end)) {
+		/* enforce minimum time */
+		finished = 0;
+	}
+	else {
+		/* don't stop till all reported interfaces are down */
+		for (i = 0; i < nbifs; i++)
+			if (ifs[i].status & IF_CHECK_PHYSICAL)
+				break;
+		if (i > nbifs)
+			finished = 0;
+	}
+
+	if (finished) {
+		set_all_leds(blink_restore);
+		return 0;
+	}
+
+	/* get either 00101010 or 00010101 from the current blink pattern */
+	pattern = (blink_pattern[blink_mode - FIRST_SIG] >> cycle) & 0x15;
+
+	setled(&leds[0], pattern & 0x10);
+	setled(&leds[1], pattern & 0x04);
+	setled(&leds[2], pattern & 0x01);
+	
+	cycle = (cycle + 1) & 1;
+	return 1;
+}
+
+#ifdef USE_STATS
+/* dumps "<name> <value>" followed by LF to <fd> */
+static void stats_put(int fd, const char *name, unsigned int value)
+{
+	char buffer[12];
+
+	fdprint(fd, name);
+	fdprint(fd, " ");
+	fdputs(fd, ultoa_r(value, buffer, sizeof(buffer)));
+}
+
+/* dumps the syscalls counters of file <pf> to <fd> */
+static void stats_put_pfile(int fd, const struct pfile *pf)
+{
+	char buffer[12];
+
+	if (!pf->reads)
+		return;
+	fdprint(fd, "file ");
+	fdprint(fd, pf->name);
+	fdprint(fd, " opens ");
+	fdprint(fd, ultoa_r(pf->opens, buffer, sizeof(buffer)));
+	fdprint(fd, " reads ");
+	fdputs(fd, ultoa_r(pf->reads, buffer, sizeof(buffer)));
+}
+
+/* dumps all statistics, to stderr in DEBUG mode, or to the stats file */
+static void stats_dump()
+{
+	struct timespec ts;
+	unsigned int uptime;
+	char name[24];
+	int fd, i;
+
+#ifdef DEBUG
+	fd = 2;
+#else
+	fd = open(stats_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uptime = ts.tv_sec - stats.start;
+
+	stats_put(fd, "uptime_s", uptime);
+	stats_put(fd, "loops", stats.loops);
+	stats_put(fd, "wakeups_per_s", uptime ? stats.loops / uptime : stats.loops);
+	stats_put(fd, "tasks", stats.tasks);
+	stats_put(fd, "timer_wakeups", stats.timer_wakeups);
+	stats_put(fd, "late_max_us", stats.late_max);
+	for (i = 0; i < sizeof(stats.late)/sizeof(stats.late[0]); i++) {
+		char buffer[12];
+
+		strcpy(name, i < sizeof(late_bounds)/sizeof(late_bounds[0]) ? "late_lt_" : "late_ge_");
+		strcat(name, ultoa_r(late_bounds[i < sizeof(late_bounds)/sizeof(late_bounds[0]) ? i : i - 1],
+		                     buffer, sizeof(buffer)));
+		strcat(name, "us");
+		stats_put(fd, name, stats.late[i]);
+	}
+	stats_put(fd, "net_calls", stats.net_calls);
+	stats_put(fd, "net_time_us", stats.net_time);
+	stats_put(fd, "cpu_calls", stats.cpu_calls);
+	stats_put(fd, "cpu_time_us", stats.cpu_time);
+	stats_put(fd, "disk_calls", stats.disk_calls);
+	stats_put(fd, "disk_time_us", stats.disk_time);
+	stats_put(fd, "netlink_reads", stats.nl_reads);
+	stats_put(fd, "signal_reads", stats.sig_reads);
+	stats_put(fd, "timer_calls", stats.timer_calls);
+	stats_put(fd, "net_ioctls", stats.net_ioctls);
+	stats_put(fd, "led_writes", stats.led_writes);
+	stats_put(fd, "if_names", if_hashed);
+	stats_put(fd, "if_buckets", if_hash_mask + 1);
+
+	stats_put_pfile(fd, &pf_netdev);
+	stats_put_pfile(fd, &pf_uptime);
+	stats_put_pfile(fd, &pf_stat);
+	stats_put_pfile(fd, &pf_interrupts);
+	stats_put_pfile(fd, &pf_loadavg);
+	stats_put_pfile(fd, &pf_ct_count);
+	stats_put_pfile(fd, &pf_ct_max);
+	for (i = 0; i < PSI_RES; i++)
+		stats_put_pfile(fd, &pf_pressure[i]);
+	for (i = 0; i < nb_disk_devs; i++)
+		stats_put_pfile(fd, &disk_devs[i].pf);
+	for (i = 0; i < NBLEDS; i++) {
+		int s;
+
+		for (s = 0; s < leds[i].nbtherm; s++)
+			stats_put_pfile(fd, &leds[i].therm[s]);
+	}
+
+	if (fd != 2)
+		close(fd);
+}
+#endif
+
+/* processes signal <sig> received by the daemon */
+void process_signal(int sig)
+{
+	int led_num;
+
+	switch (sig) {
+	case SIGUSR1:
+		fast_mode = 0;
+		break;
+	case SIGUSR2:
+		fast_mode = 1;
+		break;
+#ifdef USE_STATS
+	case SIGQUIT:
+		stats_dump();
+		break;
+#endif
+	case FIRST_SIG ... LAST_SIG-1:
+		if (!blink_mode) {
+			/* pause the leds while the blinker runs */
+			blink_restore = get_all_leds();
+			for (led_num = 0; led_num < NBLEDS; led_num++)
+				task_unqueue(&leds[led_num].task);
+		}
+		blinker_end = now + BLINK_DURATION; /* report special cond for at least 15s */
+		blink_mode = sig;
+		blinker_task.expire = now;
+		task_queue(&blinker_task);
+		break;
+	case LAST_SIG:
+		if (!blink_mode)
+			break;
+		blinker_end = now; /* immediately stop blinking */
+		blinker_task.expire = now;
+		task_queue(&blinker_task);
+		break;
+	}
+}
+
+/* reads all pending signals from the signalfd at once, or those marked
+ * pending by the fallback handler, and processes them.
+ */
+void process_signals()
+{
+	struct signalfd_siginfo ssi[16];
+	int ret, i;
+
+	if (sig_fd >= 0) {
+		while ((ret = read(sig_fd, ssi, sizeof(ssi))) > 0) {
+			STATS_INC(sig_reads);
+			for (i = 0; i < ret / sizeof(ssi[0]); i++)
+				process_signal(ssi[i].ssi_signo);
+		}
+		return;
+	}
+
+	if (!sig_any)
+		return;
+	sig_any = 0;
+	for (i = 0; i <= LAST_SIG; i++) {
+		if (sig_pending[i]) {
+			sig_pending[i] = 0;
+			process_signal(i);
+		}
+	}
+}
+
+/* fallback signal handler used when signalfd is not supported */
+void sig_handler(int sig)
+{
+	sig_pending[sig] = 1;
+	sig_any = 1;
+	signal(sig, sig_handler);
+}
+
+/* periodically refreshes the network interfaces status, or only their
+ * counters when the status is reported by link events.
+ */
+void process_net(struct task *t)
+{
+	unsigned int start = STATS_DATE();
+
+	if (nl_sock >= 0)
+		read_netdev(0);
+	else
+		check_if_status();
+	STATS_ADD(net_time, STATS_DATE() - start);
+	STATS_INC(net_calls);
+	task_schedule(t, SLEEP_500M);
+}
+
+/* immediately wakes up the network leds so that they report a link change */
+void wake_net_leds()
+{
+	int led_num;
+
+	if (blink_mode)
+		return;
+
+	for (led_num = 0; led_num < NBLEDS; led_num++) {
+		struct led *led = &leds[led_num];
+
+		if (led->type != LED_NET)
+			continue;
+		led->state = 1;
+		led->count = 0;
+		led->task.expire = now;
+		task_queue(&led->task);
+	}
+}
+
+/* processes link events and reports the changes on the network leds */
+void process_link_events()
+{
+	if (nl_recv())
+		wake_net_leds();
+}
+
+/* calls the led's management function and requeues it */
+void process_led(struct task *t)
+{
+	struct led *led = t->context;
+
+	switch (led->type) {
+	case LED_NET:
+		manage_net(led);
+		break;
+	case LED_RUNNING:
+		manage_running(led);
+		break;
+	case LED_CPU:
+	case LED_TRAFFIC:
+	case LED_ERRORS:
+	case LED_PSI:
+	case LED_LOAD:
+	case LED_THERMAL:
+	case LED_CONNTRACK:
+	case LED_IRQ:
+		manage_level(led);
+		break;
+	case LED_DISK:
+		manage_disk(led);
+		break;
+	}
+	if (led->sleep >= 0)
+		task_schedule(t, led->sleep);
+}
+
+/* wakes up the pressure leds waiting for the kernel to report a pressure */
+void process_psi_events()
+{
+	int led_num;
+
+	if (blink_mode)
+		return;
+
+	for (led_num = 0; led_num < NBLEDS; led_num++) {
+		struct led *led = &leds[led_num];
+
+		if (led->type != LED_PSI || led->task.heap >= 0)
+			continue;
+		/* the kernel reports a new stall, the last read is outdated */
+		src_pressure[led->psi_res].date = now - SAMPLE_PERIOD;
+		led->task.expire = now;
+		task_queue(&led->task);
+	}
+}
+
+/* runs the action of switch press <press>, if any. Actions "sig:<num>" are
+ * processed as if signal <num> was received, other ones are shell commands
+ * run in the background.
+ */
+static void switch_run(int press)
+{
+	const char *action = switch_actions[press];
+	struct sched_param sch;
+	struct rlimit rlim;
+	sigset_t sigs;
+	int fd;
+
+	if (!action)
+		return;
+
+#ifdef SIMUL
+	fdprint(2, "switch: ");
+	fdprint(2, switch_press_names[press]);
+	fdprint(2, " press, ");
+	fdputs(2, action);
+#endif
+	if (strncmp(action, "sig:", 4) == 0) {
+		process_signal(atoi(action + 4));
+		return;
+	}
+#ifndef SIMUL
+	if (fork() != 0)
+		return;
+
+	/* the command must not inherit our priority nor blocked signals */
+	sch.sched_priority = 0;
+	sched_setscheduler(0, SCHED_OTHER, &sch);
+	setpriority(PRIO_PROCESS, 0, 0);
+	sigemptyset(&sigs);
+	sigprocmask(SIG_SETMASK, &sigs, NULL);
+
+	/* nor our fds, or it would keep the GPIO lines claimed after we leave.
+	 * Outside of debug mode, 0-2 were closed and may have been reused. The
+	 * daemon only uses a few fds, so there is no need to check past 1024.
+	 */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0 || rlim.rlim_cur > 1024)
+		rlim.rlim_cur = 1024;
+#ifdef DEBUG
+	for (fd = 3; fd < rlim.rlim_cur; fd++)
+		close(fd);
+#else
+	for (fd = 0; fd < rlim.rlim_cur; fd++)
+		close(fd);
+	fd = open("/dev/null", O_RDWR);
+	if (fd == 0) {
+		dup(fd);
+		dup(fd);
+	}
+#endif
+	execl("/bin/sh", "sh", "-c", action, NULL);
+	_exit(1);
+#endif
+}
+
+/* follows the debounced switch state and runs the actions of the presses. A
+ * press is long once held for SWITCH_LONG, and a short one is only reported
+ * after SWITCH_DOUBLE if a double press action is set. Without edges, the
+ * switch is polled and a change needs two identical samples. With edges, the
+ * task only runs after an edge or to check a delay.
+ */
+void process_switch(struct task *t)
+{
+	int pressed = switch_pressed();
+
+	if (!switch_edges && pressed != switch_last) {
+		switch_last = pressed;
+		task_schedule(t, SWITCH_POLL);
+		return;
+	}
+
+	switch (switch_state) {
+	case SW_IDLE:
+		if (pressed) {
+			switch_state = SW_DOWN;
+			switch_date = now;
+		}
+		break;
+	case SW_DOWN:
+		if (!pressed) {
+			switch_date = now;
+			switch_state = SW_UP;
+			if (!switch_actions[PRESS_DOUBLE]) {
+				switch_state = SW_IDLE;
+				switch_run(PRESS_SHORT);
+			}
+		}
+		else if (!date_before(now, switch_date + SWITCH_LONG)) {
+			switch_state = SW_HELD;
+			switch_run(PRESS_LONG);
+		}
+		break;
+	case SW_HELD:
+		if (!pressed)
+			switch_state = SW_IDLE;
+		break;
+	case SW_UP:
+		if (pressed) {
+			switch_state = SW_HELD;
+			switch_run(PRESS_DOUBLE);
+		}
+		else if (!date_before(now, switch_date + SWITCH_DOUBLE)) {
+			switch_state = SW_IDLE;
+			switch_run(PRESS_SHORT);
+		}
+		break;
+	}
+
+	if (!switch_edges)
+		task_schedule(t, SWITCH_POLL);
+	else if (switch_state == SW_DOWN || switch_state == SW_UP) {
+		t->expire = switch_date + (switch_state == SW_DOWN ? SWITCH_LONG : SWITCH_DOUBLE);
+		task_queue(t);
+	}
+}
+
+/* flushes the switch edges and samples the switch once it settled */
+void process_switch_events()
+{
+	switch_pressed();
+	task_unqueue(&switch_task);
+	switch_task.expire = now + SWITCH_DEBOUNCE;
+	task_queue(&switch_task);
+}
+
+/* we're in a special condition, a special signal was reported and is
+ * prevalent over leds management, which are paused. We stay in this state
+ * for at least BLINK_DURATION and as long as all of the tracked interfaces
+ * are down.
+ */
+void process_blinker(struct task *t)
+{
+	int led_num;
+
+	if (handle_special_blink()) {
+		task_schedule(t, SLEEP_250M);
+		return;
+	}
+
+	/* end of processing, resume the leds */
+	blink_mode = 0;
+	for (led_num = 0; led_num < NBLEDS; led_num++) {
+		if (leds[led_num].type == LED_UNUSED)
+			continue;
+		leds[led_num].task.expire = now;
+		task_queue(&leds[led_num].task);
 	}
 }
 
-/* returns 0 if it needs to stop */
-int handle_special_blink()
+#ifdef SIMUL
+enum {
+	SIM_LINK = 0,  /* arg1 = link message type, arg2 = interface flags */
+	SIM_CPU  = 1,  /* arg1 = usage in percent, arg2 = ramp duration in us */
+	SIM_DISK = 2,  /* arg1 = I/Os per second */
+	SIM_SIG  = 3,  /* arg1 = signal number */
+	SIM_END  = 4,  /* nothing, only extends the simulation */
+	SIM_PSI  = 5,  /* arg1 = PSI_* resource, arg2 = 10s average in percent */
+	SIM_TEMP = 6,  /* arg1 = temperature in degrees Celsius */
+	SIM_CT   = 7,  /* arg1 = conntrack table occupancy in percent */
+	SIM_IRQ  = 8,  /* arg1 = interrupts per second */
+	SIM_SWITCH = 9, /* arg1 = switch pressed */
+};
+
+struct sim_event {
+	unsigned long long date; /* virtual date in microseconds */
+	int type;                /* SIM_* */
+	int arg1, arg2;
+	struct if_status *ifs;   /* interface for SIM_LINK */
+};
+
+/* scripted events sorted by date, <sim_next> is the next one to apply */
+static struct sim_event *sim_events;
+static int sim_nbevents, sim_maxevents, sim_next;
+
+/* inserts event <ev> after the events of the same date or earlier so that
+ * events sharing a date are applied in the script order.
+ */
+static void sim_add(const struct sim_event *ev)
 {
-	static int cycle;
-	int i;
-	int finished = 1;
-	unsigned char pattern;
+	int pos;
 
-	if (blinker_remain > 0) {
-		/* enforce minimum time */
-		finished = 0;
+	if (sim_nbevents == sim_maxevents) {
+		struct sim_event *new;
+
+		sim_maxevents = sim_maxevents ? sim_maxevents * 2 : 64;
+		new = realloc(sim_events, sim_maxevents * sizeof(*new));
+		if (!new)
+			die(1, "Out of memory");
+		sim_events = new;
 	}
-	else {
-		/* don't stop till all reported interfaces are down */
-		for (i = 0; i < nbifs; i++)
-			if (ifs[i].status & IF_CHECK_PHYSICAL)
-				break;
-		if (i > nbifs)
-			finished = 0;
+	for (pos = sim_nbevents; pos > 0 && sim_events[pos - 1].date > ev->date; pos--)
+		sim_events[pos] = sim_events[pos - 1];
+	sim_events[pos] = *ev;
+	sim_nbevents++;
+}
+
+/* parses one line of the simulation script. <ctx> points to the line number.
+ * Empty lines and those starting with '#' are ignored. Other ones describe an
+ * event as "<date> <event> [<args>]" where <date> is in milliseconds from the
+ * start, and <event> is one of :
+ *   - link <intf> up|nocarrier|down|absent : link status of a tracked
+ *     interface, reported as a link event. Interfaces are absent at start.
+ *   - cpu <percent> [<ms>] : CPU usage, reached linearly within <ms>.
+ *   - disk <rate> [<ms>] : disk activity in I/Os per second, for <ms> only.
+ *   - sig <num> : signal received by the daemon.
+ *   - psi cpu|memory|io <percent> : 10s average of the resource's stall time.
+ *   - temp <degrees> : temperature reported by all thermal sensors.
+ *   - conntrack <percent> : occupancy of the conntrack table.
+ *   - irq <rate> : interrupts per second of all the devices.
+ *   - switch down|up : the switch is pressed or released, with no bounce.
+ *   - end : nothing, the simulation stops after the last event.
+ * Invalid lines stop the program.
+ */
+static int sim_parse_line(char *line, void *ctx)
+{
+	struct sim_event ev;
+	char buffer[12];
+	char *word[4];
+	int nbw = 0;
+
+	(*(int *)ctx)++;
+	while (nbw < 4) {
+		while (*line == ' ' || *line == '\t')
+			line++;
+		if (!*line || *line == '#')
+			break;
+		word[nbw++] = line;
+		while (*line && *line != ' ' && *line != '\t')
+			line++;
+		if (*line)
+			*line++ = 0;
 	}
 
-	if (finished) {
-		set_all_leds(blink_restore);
+	if (!nbw)
 		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	if (nbw < 2 || !isdigit(*word[0]))
+		goto bad;
+	ev.date = strtoull(word[0], NULL, 10) * 1000;
+
+	if (strcmp(word[1], "link") == 0 && nbw == 4) {
+		ev.type = SIM_LINK;
+		ev.ifs = matchif(word[2]);
+		ev.arg1 = RTM_NEWLINK;
+		if (!ev.ifs)
+			goto bad;
+		if (strcmp(word[3], "up") == 0)
+			ev.arg2 = IFF_UP | IFF_LOWER_UP;
+		else if (strcmp(word[3], "nocarrier") == 0)
+			ev.arg2 = IFF_UP;
+		else if (strcmp(word[3], "absent") == 0)
+			ev.arg1 = RTM_DELLINK;
+		else if (strcmp(word[3], "down") != 0)
+			goto bad;
+	}
+	else if (strcmp(word[1], "cpu") == 0 && nbw >= 3) {
+		ev.type = SIM_CPU;
+		ev.arg1 = atoi(word[2]);
+		if (ev.arg1 < 0 || ev.arg1 > 100)
+			goto bad;
+		if (nbw > 3)
+			ev.arg2 = atoi(word[3]) * 1000;
+	}
+	else if (strcmp(word[1], "disk") == 0 && nbw >= 3) {
+		ev.type = SIM_DISK;
+		ev.arg1 = atoi(word[2]);
+		if (nbw > 3) {
+			/* the activity stops after the burst */
+			sim_add(&ev);
+			ev.date += atoi(word[3]) * 1000ULL;
+			ev.arg1 = 0;
+		}
+	}
+	else if (strcmp(word[1], "sig") == 0 && nbw == 3) {
+		ev.type = SIM_SIG;
+		ev.arg1 = atoi(word[2]);
+		if (ev.arg1 <= 0 || ev.arg1 > LAST_SIG)
+			goto bad;
+	}
+	else if (strcmp(word[1], "psi") == 0 && nbw == 4) {
+		ev.type = SIM_PSI;
+		if (strcmp(word[2], "cpu") == 0)
+			ev.arg1 = PSI_CPU;
+		else if (strcmp(word[2], "memory") == 0)
+			ev.arg1 = PSI_MEMORY;
+		else if (strcmp(word[2], "io") == 0)
+			ev.arg1 = PSI_IO;
+		else
+			goto bad;
+		ev.arg2 = atoi(word[3]);
+	}
+	else if (strcmp(word[1], "temp") == 0 && nbw == 3) {
+		ev.type = SIM_TEMP;
+		ev.arg1 = atoi(word[2]);
+	}
+	else if (strcmp(word[1], "conntrack") == 0 && nbw == 3) {
+		ev.type = SIM_CT;
+		ev.arg1 = atoi(word[2]);
+		if (ev.arg1 < 0 || ev.arg1 > 100)
+			goto bad;
+	}
+	else if (strcmp(word[1], "irq") == 0 && nbw == 3) {
+		ev.type = SIM_IRQ;
+		ev.arg1 = atoi(word[2]);
 	}
+	else if (strcmp(word[1], "switch") == 0 && nbw == 3) {
+		ev.type = SIM_SWITCH;
+		if (strcmp(word[2], "down") == 0)
+			ev.arg1 = 1;
+		else if (strcmp(word[2], "up") != 0)
+			goto bad;
+	}
+	else if (strcmp(word[1], "end") == 0 && nbw == 2)
+		ev.type = SIM_END;
+	else
+		goto bad;
+
+	sim_add(&ev);
+	return 0;
+ bad:
+	fdprint(2, "Simulation script line ");
+	fdprint(2, ultoa_r(*(int *)ctx, buffer, sizeof(buffer)));
+	die(1, ": invalid event");
+	return 1;
+}
 
-	/* get either 00101010 or 00010101 from the current blink pattern */
-	pattern = (blink_pattern[blink_mode - FIRST_SIG] >> cycle) & 0x15;
+/* loads the simulation script from file <name> */
+static void sim_load(const char *name)
+{
+	struct pfile pf = { .name = name, .fd = -1 };
+	int line = 0;
 
-	setled(LED1_MASK, (pattern & 0x10) ? LED_ON : ~LED_ON, LED1_PORT);
-	setled(LED2_MASK, (pattern & 0x04) ? LED_ON : ~LED_ON, LED2_PORT);
-	setled(LED3_MASK, (pattern & 0x01) ? LED_ON : ~LED_ON, LED3_PORT);
-	
-	cycle = (cycle + 1) & 1;
-	return 1;
+	if (readlines(&pf, sim_parse_line, &line) < 0)
+		die(-1, "Cannot read simulation script");
+	close(pf.fd);
 }
 
-void sig_handler(int sig)
+/* applies the scripted event <ev> at the current virtual date */
+static void sim_apply(const struct sim_event *ev)
 {
-	switch (sig) {
-	case SIGUSR1:
-		fast_mode = 0;
+	switch (ev->type) {
+	case SIM_LINK:
+		if (nl_update_if(ev->ifs, ev->arg1, ev->arg2))
+			wake_net_leds();
 		break;
-	case SIGUSR2:
-		fast_mode = 1;
+	case SIM_CPU:
+		sim_cpu_from = sim_cpu_usage();
+		sim_cpu_to = ev->arg1;
+		sim_ramp_start = sim_clock;
+		sim_ramp_end = sim_clock + ev->arg2;
 		break;
-	case FIRST_SIG ... LAST_SIG-1:
-		if (!blink_mode)
-			blink_restore = get_all_leds();
-		blinker_remain = BLINK_DURATION; /* report special cond for at least 15s */
-		blinker_sleep = 0;
-		blink_mode = sig;
+	case SIM_DISK:
+		sim_disk_accrue();
+		sim_disk_rate = ev->arg1;
 		break;
-	case LAST_SIG:
-		if (!blink_mode)
-			blink_restore = get_all_leds();
-		blinker_remain = 0; /* immediately stop blinking */
-		blinker_sleep = 0;
+	case SIM_SIG:
+		process_signal(ev->arg1);
+		break;
+	case SIM_PSI:
+		psi_avg10[ev->arg1] = ev->arg2 * 100;
+		break;
+	case SIM_TEMP:
+		sim_temp = ev->arg1 * 1000;
+		break;
+	case SIM_CT:
+		ct_count = ev->arg1;
+		ct_max = 100;
+		break;
+	case SIM_IRQ:
+		sim_irq_accrue();
+		sim_irq_rate = ev->arg1;
+		break;
+	case SIM_SWITCH:
+		sim_switch = ev->arg1;
+		if (switch_task.process)
+			process_switch_events();
 		break;
 	}
-	signal(sig, sig_handler);
 }
 
-static inline void init_leds(struct led *led)
+/* advances the virtual clock to the next task wakeup or scripted event,
+ * whichever comes first, and applies the events due. Exits once all events
+ * were applied.
+ */
+static void sim_wait()
 {
-	led[0].port = LED1_PORT;
-	led[0].mask = LED1_MASK;
+	unsigned long long date;
+
+	if (sim_next == sim_nbevents)
+		exit(0);
+
+	date = sim_events[sim_next].date;
+	if (nbtasks) {
+		int delay = wakeup_date(tasks[0]->expire) - now;
+
+		if (delay < 0)
+			delay = 0;
+		if (sim_clock + delay < date)
+			date = sim_clock + delay;
+	}
+	sim_clock = date;
+	now = get_date();
 
-	led[1].port = LED2_PORT;
-	led[1].mask = LED2_MASK;
+	while (sim_next < sim_nbevents && sim_events[sim_next].date <= sim_clock)
+		sim_apply(&sim_events[sim_next++]);
+}
+#endif
+
+static inline void init_leds(struct led *led)
+{
+	int i;
 
-	led[2].port = LED3_PORT;
-	led[2].mask = LED3_MASK;
+	for (i = 0; i < NBLEDS; i++) {
+		led[i].task.heap = -1;
+		led[i].psi_evh.fd = -1;
+	}
 }
 
+#ifndef BENCH
 int main(int argc, char **argv)
 {
 	struct sched_param sch;
@@ -983,15 +4150,28 @@ int main(int argc, char **argv)
 	const char *pidname = NULL;
 	int pidfd = 0;
 	int pid, fd;
+	int led_num;
+	sigset_t sigs;
 	int sched;
 	int prio = 0;
 	int switch_mode = 0;
 	int led_mask = 0;
+	int rate_mask = 0; /* leds with a threshold set by -E */
+
+#ifndef DEBUG
+	/* close inherited fds, only keep stdin/stdout/stderr for now */
+	for (fd = 3; fd < 1024; fd++)
+		close(fd);
+#endif
 
 	/* cheaper than pre-initializing the array in the .data section */
 	init_leds(leds);
 	net_sock = -2; /* uninitialized */
 
+	/* each interface takes two arguments */
+	if (!if_alloc(argc / 2))
+		die(1, "Out of memory");
+
 	argc--; argv++;
 	while (argc > 0) {
 		if (**argv != '-')
@@ -1014,6 +4194,20 @@ int main(int argc, char **argv)
 				die(1, "LED already assigned to non-cpu polling");
 			led->type = LED_CPU;
 		}
+		else if (argv[0][1] == 'a') {
+			if (!led)
+				die(1, "Must specify led before load mode");
+			if (led->type != LED_UNUSED && led->type != LED_LOAD)
+				die(1, "LED already assigned to non-load polling");
+			led->type = LED_LOAD;
+		}
+		else if (argv[0][1] == 'k') {
+			if (!led)
+				die(1, "Must specify led before conntrack mode");
+			if (led->type != LED_UNUSED && led->type != LED_CONNTRACK)
+				die(1, "LED already assigned to non-conntrack polling");
+			led->type = LED_CONNTRACK;
+		}
 		else if (argv[0][1] == 'r') {
 			if (!led)
 				die(1, "Must specify led before running mode");
@@ -1033,6 +4227,8 @@ int main(int argc, char **argv)
 			prio = 1;
 		else if (argv[0][1] == 'S')
 			switch_mode = 1;
+		else if (argv[0][1] == 'P')
+			net_poll = 1;
 
 		/* options with two args below */
 		else if (argc < 2)
@@ -1050,7 +4246,10 @@ int main(int argc, char **argv)
 				/* interface specified before any led, just track it without
 				 * associating it.
 				 */
-				getif(argv[1], IF_CHECK_BOTH);
+				if (strpbrk(argv[1], IF_PATTERN_CHARS))
+					newpattern(argv[1], IF_CHECK_BOTH, NULL);
+				else
+					getif(argv[1], IF_CHECK_BOTH);
 			}
 			last_interf = argv[1];
 			net_sock = -1;
@@ -1080,18 +4279,159 @@ int main(int argc, char **argv)
 			net_sock = -1;
 			argc--; argv++;
 		}
+		else if (argv[0][1] == 'n') {
+			if (!led)
+				die(1, "Must specify led before traffic mode");
+			if (led->type != LED_UNUSED && led->type != LED_TRAFFIC)
+				die(1, "LED already assigned to non-traffic polling");
+			led->type = LED_TRAFFIC;
+			led->intf = newif(argv[1], IF_CHECK_PRESENT | IF_CHECK_COUNTERS, led->intf);
+			if (!led->intf)
+				die(1, "Too many interfaces");
+			net_counters = 1;
+			net_sock = -1;
+			argc--; argv++;
+		}
+		else if (argv[0][1] == 'e') {
+			if (!led)
+				die(1, "Must specify led before error mode");
+			if (led->type != LED_UNUSED && led->type != LED_ERRORS)
+				die(1, "LED already assigned to non-error polling");
+			led->type = LED_ERRORS;
+			led->intf = newif(argv[1], IF_CHECK_PRESENT | IF_CHECK_COUNTERS, led->intf);
+			if (!led->intf)
+				die(1, "Too many interfaces");
+			net_counters = 1;
+			argc--; argv++;
+		}
+		else if (argv[0][1] == 'w') {
+			if (!led)
+				die(1, "Must specify led before pressure mode");
+			if (led->type != LED_UNUSED && led->type != LED_PSI)
+				die(1, "LED already assigned to non-pressure polling");
+			led->type = LED_PSI;
+			if (strcmp(argv[1], "cpu") == 0)
+				led->psi_res = PSI_CPU;
+			else if (strcmp(argv[1], "memory") == 0)
+				led->psi_res = PSI_MEMORY;
+			else if (strcmp(argv[1], "io") == 0)
+				led->psi_res = PSI_IO;
+			else
+				die(1, usage);
+			argc--; argv++;
+		}
+		else if (argv[0][1] == 'T') {
+			if (!led)
+				die(1, "Must specify led before thermal mode");
+			if (led->type != LED_UNUSED && led->type != LED_THERMAL)
+				die(1, "LED already assigned to non-thermal polling");
+			led->type = LED_THERMAL;
+			if (!thermal_add(led, argv[1]))
+				die(1, "No thermal sensor found");
+			argc--; argv++;
+		}
+		else if (argv[0][1] == 'v') {
+			if (!led)
+				die(1, "Must specify led before interrupt mode");
+			if (led->type != LED_UNUSED && led->type != LED_IRQ)
+				die(1, "LED already assigned to non-interrupt polling");
+			if (led->type == LED_UNUSED && !((rate_mask >> (led - leds)) & 1))
+				led->threshold = DEF_IRQ_RATE;
+			led->type = LED_IRQ;
+			if (!irq_led_add(led, argv[1]))
+				die(1, "Out of memory");
+			argc--; argv++;
+		}
+		else if (argv[0][1] == 'K') {
+			if (!led)
+				die(1, "Must specify led before trip point");
+			led->trip = atoi(argv[1]) * 1000;
+			argc--; argv++;
+		}
+		else if (argv[0][1] == 'E') {
+			if (!led)
+				die(1, "Must specify led before threshold");
+			led->threshold = atoi(argv[1]);
+			rate_mask |= 1 << (led - leds);
+			argc--; argv++;
+		}
 		else if (argv[0][1] == 'l') {
 			int l = atoi(argv[1]);
 			if (l < 1 || l > 3)
 				die(1, usage);
 			led = &leds[l - 1];
+			led->threshold = DEF_THRESHOLD;
+			led->trip = DEF_TRIP * 1000;
+			rate_mask &= ~(1 << (l-1));
 			led_mask |= (1 << (l-1));
 			argc--; argv++;
 		}
+		else if (argv[0][1] == 'L') {
+			int ms = atoi(argv[1]);
+
+			if (ms <= 0)
+				die(1, usage);
+			grid = ms * 1000;
+			argc--; argv++;
+		}
+#ifdef USE_STATS
+		else if (argv[0][1] == 'q') {
+			stats_file = argv[1];
+			argc--; argv++;
+		}
+#endif
+		else if (argv[0][1] == 'B') {
+			int i;
+
+			backend_args = strchr(argv[1], ':');
+			if (backend_args)
+				*backend_args++ = 0;
+			else
+				backend_args = "";
+
+			for (i = 0; i < sizeof(backends)/sizeof(backends[0]); i++)
+				if (strcmp(argv[1], backends[i].name) == 0)
+					break;
+			if (i == sizeof(backends)/sizeof(backends[0]))
+				die(1, usage);
+			backend = &backends[i];
+			argc--; argv++;
+		}
+		else if (argv[0][1] == 'D') {
+			if (!led)
+				die(1, "Must specify led before disk mode");
+			if (led->type != LED_UNUSED && led->type != LED_DISK)
+				die(1, "LED already assigned to non-disk polling");
+			led->type = LED_DISK;
+			led->disk_name = argv[1];
+			argc--; argv++;
+		}
+		else if (argv[0][1] == 'c') {
+			if (!led)
+				die(1, "Must specify led before cpu mode");
+			if (led->type != LED_UNUSED && led->type != LED_CPU)
+				die(1, "LED already assigned to non-cpu polling");
+			led->type = LED_CPU;
+			if (strcmp(argv[1], "mean") == 0)
+				led->cpu.mode = CPU_MEAN;
+			else if (strcmp(argv[1], "max") == 0)
+				led->cpu.mode = CPU_MAX;
+			else if (isdigit(*argv[1]))
+				led->cpu.mode = CPU_CORE + atoi(argv[1]);
+			else
+				die(1, usage);
+			argc--; argv++;
+		}
 		else if (argv[0][1] == 'p') {
 			pidname = argv[1];
 			argc--; argv++;
 		}
+#ifdef SIMUL
+		else if (argv[0][1] == 'X') {
+			sim_script = argv[1];
+			argc--; argv++;
+		}
+#endif
 
 		/* options with three args below */
 		else if (argc < 3)
@@ -1108,14 +4448,28 @@ int main(int argc, char **argv)
 			argc--; argv++;
 			argc--; argv++;
 		}
+		else if (argv[0][1] == 'x') {
+			/* action upon switch press. Format: -x <press> <action> */
+			int press;
+
+			for (press = 0; press < PRESSES; press++)
+				if (strcmp(argv[1], switch_press_names[press]) == 0)
+					break;
+			if (press == PRESSES)
+				die(1, usage);
+
+			switch_actions[press] = argv[2];
+			argc--; argv++;
+			argc--; argv++;
+		}
 		else
 			die(1, usage);
 		argc--; argv++;
 	}
 
-	if (iopl(3) == -1)
+	if (backend->init(backend_args) < 0)
 #ifndef DEBUG
-		die(-1, "Cannot get I/O port");
+		die(-1, "Cannot initialize LED backend");
 #else
 	;
 #endif
@@ -1127,7 +4481,7 @@ int main(int argc, char **argv)
 	 *     gives some time to the operator to abort what's in progress.
 	 */
 	if (switch_mode) {
-		int light = LED_ON;
+		int light = 1;
 		int i, count;
 
 		if (!switch_pressed())
@@ -1144,33 +4498,37 @@ int main(int argc, char **argv)
 		for (count = 13; count > 0 && switch_pressed(); count--) {
 			for (i = 0; i <= 2; i++) {
 				if ((led_mask >> i) & 1)
-					setled(leds[i].mask, light, leds[i].port);
+					setled(&leds[i], light);
 			}
-			usleep(150000);
-			light = ~light;
+			flush_leds();
+			switch_wait(150000);
+			light = !light;
 		}
 
 		if (count) {
 			/* switch was released before the end, restore normal LED status (ON/OFF/OFF) */
 			if (led_mask & 1)
-				setled(LED1_MASK, LED_ON, LED1_PORT);
+				setled(&leds[0], 1);
 			if (led_mask & 2)
-				setled(LED2_MASK, ~LED_ON, LED2_PORT);
+				setled(&leds[1], 0);
 			if (led_mask & 4)
-				setled(LED3_MASK, ~LED_ON, LED3_PORT);
+				setled(&leds[2], 0);
+			flush_leds();
 			return 1;
 		}
 
 		/* The switch was kept pressed. Turn all leds on and wait for it
 		 * to be released so that it does not affect further operations.
+		 * Backends reporting edges are not polled meanwhile.
 		 */
 
 		while (switch_pressed()) {
 			for (i = 0; i <= 2; i++) {
 				if ((led_mask >> i) & 1)
-					setled(leds[i].mask, LED_ON, leds[i].port);
+					setled(&leds[i], 1);
 			}
-			usleep(100000);
+			flush_leds();
+			switch_wait(-1);
 		}
 
 		/* let the external code run with leds still turned on, to indicate
@@ -1180,11 +4538,17 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
-	/* we want at least one led or one blink pattern! */
+	/* learn the state of the leds we may have to restore */
+	init_shadow();
+
+	/* we want at least one led, one blink pattern or one switch action! */
 	if (!led_mask && !blink_pattern[0] &&
-	    memcmp(blink_pattern, blink_pattern + 1, sizeof(blink_pattern)-1) == 0)
+	    memcmp(blink_pattern, blink_pattern + 1, sizeof(blink_pattern)-1) == 0 &&
+	    !switch_actions[PRESS_SHORT] && !switch_actions[PRESS_LONG] &&
+	    !switch_actions[PRESS_DOUBLE])
 		die(1, usage);
 
+#ifndef SIMUL
 	if (net_sock == -1) {
 		/* at least one interface requires network status */
 		net_sock = socket(PF_INET, SOCK_DGRAM, 0);
@@ -1212,14 +4576,9 @@ int main(int argc, char **argv)
 		sched_setscheduler(0, SCHED_OTHER, &sch);
 		setpriority(PRIO_PROCESS, 0, prio);
 	}
+#endif /* SIMUL */
 
-	signal(SIGUSR1, sig_handler);
-	signal(SIGUSR2, sig_handler);
-	for (fd = FIRST_SIG; fd <= LAST_SIG; fd++)
-		signal(fd, sig_handler);  /* and enable signal */
-
-
-#ifndef DEBUG
+#if !defined(DEBUG) && !defined(SIMUL)
 	if (pidname) {
 		pidfd = open(pidname, O_WRONLY|O_CREAT|O_TRUNC);
 		if (pidfd < 0)
@@ -1229,7 +4588,7 @@ int main(int argc, char **argv)
 	chdir("/");
 
 	/* close only stdin/stdout/stderr (not dgram socket or pidfile) */
-	for (fd = 0; fd < 1024; fd++)
+	for (fd = 0; fd < 3; fd++)
 		if (net_sock != fd && (!pidname || fd != pidfd))
 			close(fd);
 
@@ -1248,91 +4607,360 @@ int main(int argc, char **argv)
 		exit(0);
 #endif
 
+	trash_size = TRASH_MIN;
+	trash = malloc(trash_size);
+	if (!trash)
+		die(1, "Out of memory");
+
+#ifdef SIMUL
+	if (!sim_script)
+		die(1, usage);
+	sim_load(sim_script);
+#endif
+
 	/* mini-scheduler
-	 * This one is only based on delays and not deadlines. This makes it
-	 * simpler and more robust against time changes. However it is not
-	 * scalable and should never process hundreds of tasks.
+	 * Tasks are woken up at absolute deadlines on the monotonic clock, so
+	 * neither the processing time nor late wakeups make the timings drift,
+	 * and the clock is not affected by system time changes.
 	 */
-	while (1) {
-		static int net_sleep;
-		int led_num;
-		int sleep_time = MAXSLEEP;
+#ifndef SIMUL
+	ep_fd = epoll_create(4);
+	if (ep_fd < 0)
+		die(-5, "Cannot create epoll fd");
+
+	timer_evh.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (timer_evh.fd >= 0)
+		ev_register(&timer_evh, timer_evh.fd, timer_expired);
+#endif
+
+	now = get_date();
+	grid_base = now;
+#ifdef DEBUG
+	wakeups_last_report = now;
+#endif
+#ifdef USE_STATS
+	{
+		struct timespec ts;
 
-		/* use this if we need to check network status */
-		if (nbifs && net_sleep <= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		stats.start = ts.tv_sec;
+	}
+#endif
+	if (grid) {
+		/* let the kernel also group our wakeups with other ones */
+		prctl(PR_SET_TIMERSLACK, grid * 1000UL / 4, 0, 0, 0);
+	}
+
+	nl_sock = -1;
+#ifndef SIMUL
+	/* in simulation, the link status only changes on scripted link events */
+	if (if_tracked || nbifp) {
+		/* Link events are preferred over polling when supported. The
+		 * initial status still needs to be polled once.
+		 */
+		if (!net_poll)
+			nl_sock = nl_open();
+		if (nl_sock >= 0 && ev_register(&nl_evh, nl_sock, process_link_events) < 0) {
+			close(nl_sock);
+			nl_sock = -1;
+		}
+		if (nl_sock >= 0)
 			check_if_status();
-			net_sleep = SLEEP_500M;
-			sleep_time = net_sleep;
-		}
-
-		if (blink_mode && blinker_sleep <= 0) {
-			/* we're in a special condition, a special signal was
-			 * reported and is prevalent over leds management.
-			 * We stay in this state for at least signal_ms and
-			 * as long as all of the tracked interfaces are down.
-			 */
-			if (!handle_special_blink()) {
-				/* end of processing */
-				blink_mode = 0;
-				blinker_sleep = 0;
-			}
+		if (nl_sock < 0 || net_counters)
+			task_init(&net_task, process_net, NULL);
+	}
+#endif
 
-			blinker_sleep = SLEEP_250M;
-			if (blinker_sleep < sleep_time)
-				sleep_time = blinker_sleep;
-		} else {
-			for (led_num = 0; led_num < 3; led_num++) {
-				led = &leds[led_num];
+#ifndef SIMUL
+	/* pressure leds are woken up by the kernel when supported */
+	for (led_num = 0; led_num < NBLEDS; led_num++) {
+		struct evh *h = &leds[led_num].psi_evh;
 
-				if (led->type == LED_UNUSED)
-					continue;
+		if (leds[led_num].type != LED_PSI)
+			continue;
+		fd = psi_trigger(&leds[led_num]);
+		if (fd >= 0 && ev_register(h, fd, process_psi_events) < 0) {
+			close(fd);
+			h->fd = -1;
+		}
+	}
+#endif
 
-				if (led->sleep > 0)
-					continue;
+	for (led_num = 0; led_num < NBLEDS; led_num++) {
+		if (leds[led_num].type != LED_UNUSED)
+			task_init(&leds[led_num].task, process_led, &leds[led_num]);
+	}
 
-				/* led timer expired */
-				switch (led->type) {
-				case LED_NET:
-					manage_net(led);
-					break;
-				case LED_RUNNING:
-					manage_running(led);
-					break;
-				case LED_CPU:
-					manage_cpu(led);
-					break;
-				case LED_DISK:
-					manage_disk(led);
-					break;
-				}
+	blinker_task.heap = -1;
+	blinker_task.process = process_blinker;
+
+	/* the switch is only watched if an action is set for it */
+	if (switch_actions[PRESS_SHORT] || switch_actions[PRESS_LONG] ||
+	    switch_actions[PRESS_DOUBLE]) {
+#ifdef SIMUL
+		switch_edges = 1;
+#else
+		fd = backend->switch_events ? backend->switch_events() : -1;
+		if (fd >= 0 && ev_register(&switch_evh, fd, process_switch_events) == 0)
+			switch_edges = 1;
+		/* commands are not waited for */
+		signal(SIGCHLD, SIG_IGN);
+#endif
+		/* a press in progress at startup is ignored */
+		switch_last = switch_pressed();
+		switch_state = switch_last ? SW_HELD : SW_IDLE;
+		task_init(&switch_task, process_switch, NULL);
+		if (switch_edges)
+			task_unqueue(&switch_task);
+	}
+
+#ifndef SIMUL
+	/* signals are read from a signalfd so that they are processed
+	 * synchronously in the loop, and in batches.
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+#ifdef USE_STATS
+	sigaddset(&sigs, SIGQUIT);
+#endif
+	for (fd = FIRST_SIG; fd <= LAST_SIG; fd++)
+		sigaddset(&sigs, fd);
+
+	sig_fd = signalfd(-1, &sigs, SFD_NONBLOCK);
+	if (sig_fd >= 0 && ev_register(&sig_evh, sig_fd, process_signals) < 0) {
+		close(sig_fd);
+		sig_fd = -1;
+	}
+
+	if (sig_fd >= 0) {
+		sigprocmask(SIG_BLOCK, &sigs, NULL);
+	} else {
+		signal(SIGUSR1, sig_handler);
+		signal(SIGUSR2, sig_handler);
+#ifdef USE_STATS
+		signal(SIGQUIT, sig_handler);
+#endif
+		for (fd = FIRST_SIG; fd <= LAST_SIG; fd++)
+			signal(fd, sig_handler);  /* and enable signal */
+	}
+#endif
+
+	while (1) {
+		struct epoll_event ev[8];
+		int nbev, timeout;
+
+		/* signals caught by the fallback handler */
+		if (sig_fd < 0)
+			process_signals();
+
+		/* run all expired tasks, they will requeue themselves */
+		while (nbtasks && !date_before(now, tasks[0]->expire)) {
+			struct task *t = tasks[0];
+
+			task_unqueue(t);
+			t->process(t);
+			STATS_INC(tasks);
+		}
+
+		/* apply all LED changes made by the tasks at once */
+		flush_leds();
+
+#ifdef SIMUL
+		/* jump to the next date of interest instead of sleeping */
+		sim_wait();
+		STATS_INC(loops);
+#else
+		/* Sleep till the next deadline or any event. Without timerfd,
+		 * the epoll timeout is used, rounded up to the next millisecond
+		 * and limited so that signals caught between the check and the
+		 * sleep are not delayed too much.
+		 */
+		timeout = -1;
+		if (timer_evh.fd >= 0) {
+			if (nbtasks)
+				timer_arm(tasks[0]->expire);
+		}
+		else {
+			timeout = MAXSLEEP;
+			if (nbtasks) {
+				timeout = wakeup_date(tasks[0]->expire) - get_date();
+				if (timeout > MAXSLEEP)
+					timeout = MAXSLEEP;
+				if (timeout < 0)
+					timeout = 0;
 			}
+			timeout = (timeout + 999) / 1000;
+		}
+
+		nbev = epoll_wait(ep_fd, ev, sizeof(ev)/sizeof(ev[0]), timeout);
+		now = get_date();
+
+		STATS_INC(loops);
+
+#ifdef DEBUG
+		if (!date_before(now, wakeups_last_report + 10 * SLEEP_1SEC)) {
+			printf("wakeups: %u.%u/s\n", (stats.loops - wakeups_last) / 10,
+			       (stats.loops - wakeups_last) % 10);
+			wakeups_last = stats.loops;
+			wakeups_last_report = now;
+		}
+#endif
+
+		while (nbev > 0) {
+			struct evh *h = ev[--nbev].data.ptr;
+
+			h->iocb();
+		}
+#endif
+	}
+}
+
+#else /* BENCH */
+
+/* Benchmark of the parsers against captured files. Each argument has the
+ * form <kind>:<file>[=<expected>] where <kind> is one of netdev, uptime,
+ * stat or interrupts. The file is parsed <loops> times after a first warm-up
+ * parse, then the parse time, the number of allocations and the extracted
+ * value are reported. The value is the number of interfaces passed with -i
+ * found in netdev files, the total CPU time for uptime and stat files, and
+ * the number of interrupts of the devices matching the patterns passed with
+ * -I, or of IDE devices by default, for interrupts files. If <expected> is
+ * set, it is compared to the value and the exit status reports mismatches.
+ */
+int main(int argc, char **argv)
+{
+	struct pfile *pf;
+	struct led led, irq_led;
+	char buffer[24];
+	int loops = 1000;
+	int errors = 0;
+	int arg, loop;
+
+	trash_size = TRASH_MIN;
+	trash = malloc(trash_size);
+	if_alloc(argc / 2);
+	memset(&irq_led, 0, sizeof(irq_led));
+
+	for (arg = 1; arg < argc; arg++) {
+		struct timespec t0, t1;
+		unsigned long long ns;
+		unsigned int value, allocs;
+		char *kind, *file, *exp;
+		struct if_status *cur;
+
+		if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc) {
+			loops = atoi(argv[++arg]);
+			if (loops <= 0)
+				loops = 1;
+			continue;
+		}
+		if (strcmp(argv[arg], "-i") == 0 && arg + 1 < argc) {
+			if (strpbrk(argv[++arg], IF_PATTERN_CHARS))
+				newpattern(argv[arg], IF_CHECK_NONE, NULL);
+			else
+				getif(argv[arg], IF_CHECK_NONE);
+			continue;
+		}
+		if (strcmp(argv[arg], "-I") == 0 && arg + 1 < argc) {
+			if (!irq_led_add(&irq_led, argv[++arg]))
+				die(1, "Out of memory");
+			continue;
+		}
 
-			for (led_num = 0; led_num < 3; led_num++) {
-				led = &leds[led_num];
-				if (led->type != LED_UNUSED && led->sleep < sleep_time)
-					sleep_time = led->sleep;
+		kind = argv[arg];
+		file = strchr(kind, ':');
+		if (!file)
+			die(1, "Usage: alix-leds-bench [-n loops] [-i intf]* [-I dev]* {kind:file[=expected]}*");
+		*file++ = 0;
+		exp = strchr(file, '=');
+		if (exp)
+			*exp++ = 0;
+
+		if (strcmp(kind, "netdev") == 0)
+			pf = &pf_netdev;
+		else if (strcmp(kind, "uptime") == 0)
+			pf = &pf_uptime;
+		else if (strcmp(kind, "stat") == 0)
+			pf = &pf_stat;
+		else if (strcmp(kind, "interrupts") == 0)
+			pf = &pf_interrupts;
+		else
+			die(1, "Unknown file kind");
+
+		if (pf->fd >= 0)
+			close(pf->fd);
+		pf->name = file;
+		pf->fd = -1;
+		irq_nblines = 0;
+
+		memset(&led, 0, sizeof(led));
+		led.ide.nbstats = -1;
+		if (irq_led.nbirqs) {
+			led.irqs = irq_led.irqs;
+			led.nbirqs = irq_led.nbirqs;
+		}
+		else {
+			irq_led_add(&led, "ide*");
+			irq_led_add(&led, "pata*");
+		}
+		value = 0;
+		allocs = 0;
+		ns = 0;
+
+		/* the first round is the warm-up */
+		for (loop = -1; loop < loops; loop++) {
+			if (!loop) {
+				allocs = bench_allocs;
+				clock_gettime(CLOCK_MONOTONIC, &t0);
 			}
+
+			/* the sources must be read again */
+			src_uptime.date = src_stat.date = src_interrupts.date = -SAMPLE_PERIOD;
+			if (pf == &pf_netdev)
+				check_if_status();
+			else if (pf == &pf_uptime)
+				update_cpu(&led);
+			else if (pf == &pf_stat)
+				update_cpu_stat(&led);
+			else
+				update_disk(&led);
 		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+		allocs = bench_allocs - allocs;
 
-		/* Sleep but stop on signals. We will drift but its not dramatic */
-		if (usleep(sleep_time) != 0)
-			sleep_time = 0;
-
-		/* update the network checker's sleep time */
-		if (nbifs)
-			net_sleep -= sleep_time;
-
-		if (blink_mode) {
-			blinker_sleep -= sleep_time;
-			if (blinker_remain > 0) /* remain zero once zero */
-				blinker_remain -= sleep_time;
-		} else {
-			/* update all leds' sleep time */
-			for (led_num = 0; led_num < 3; led_num++) {
-				led = &leds[led_num];
-				if (led->type != LED_UNUSED)
-					led->sleep -= sleep_time;
+		if (pf == &pf_netdev) {
+			for (cur = if_tracked; cur; cur = cur->next)
+				value += !!(cur->status & IF_CHECK_PRESENT);
+		}
+		else if (pf == &pf_uptime)
+			value = led.cpu.cpu_total[1];
+		else if (pf == &pf_stat)
+			value = led.cpu.nbcpu ? led.cpu.prev[0].total : 0;
+		else
+			value = led.ide.count[1];
+
+		fdprint(1, kind);
+		fdprint(1, " ");
+		fdprint(1, file);
+		fdprint(1, " : ");
+		fdprint(1, ultoa_r(ns / loops, buffer, sizeof(buffer)));
+		fdprint(1, " ns/parse, ");
+		fdprint(1, ultoa_r(allocs, buffer, sizeof(buffer)));
+		fdprint(1, " allocs, value ");
+		fdprint(1, ultoa_r(value, buffer, sizeof(buffer)));
+		if (exp) {
+			if (strtoul(exp, NULL, 10) == value)
+				fdprint(1, " OK");
+			else {
+				fdprint(1, " FAIL, expected ");
+				fdprint(1, exp);
+				errors++;
 			}
 		}
+		fdputs(1, "");
 	}
+	return !!errors;
 }
+#endif /* BENCH */